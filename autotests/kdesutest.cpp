@@ -8,16 +8,35 @@
 #define ROOTPASSWORD "ilovekde"
 #include "config-kdesutest.h"
 
+#include <QDateTime>
+#include <QFile>
 #include <QObject>
+#include <QProcess>
+#include <QScopeGuard>
+#include <QSignalSpy>
+#include <QStandardPaths>
 #include <QString>
+#include <QTemporaryDir>
 #include <QTest>
 
 #include <KConfig>
 #include <KConfigGroup>
 #include <KSharedConfig>
 
+#include "execjob.h"
+#include "kcookie_p.h"
 #include "suprocess.h"
 
+#include <pwd.h>
+#include <unistd.h>
+#ifdef Q_OS_LINUX
+#include <sched.h>
+#endif
+
+#include <algorithm>
+#include <optional>
+#include <utility>
+
 namespace KDESu
 {
 class KdeSuTest : public QObject
@@ -29,12 +48,14 @@ private Q_SLOTS:
         QStandardPaths::setTestModeEnabled(true);
     }
 
-    void editConfig(QString command, QString commandPath)
+    void editConfig(QString command, QString commandPath, QString kdesuStubPath = QString())
     {
         KSharedConfig::Ptr config = KSharedConfig::openConfig();
         KConfigGroup group(config, QStringLiteral("super-user-command"));
         group.writeEntry("super-user-command", command);
-        QString kdesuStubPath = QString::fromLocal8Bit(CMAKE_RUNTIME_OUTPUT_DIRECTORY) + QString::fromLocal8Bit("/kdesu_stub");
+        if (kdesuStubPath.isEmpty()) {
+            kdesuStubPath = QString::fromLocal8Bit(CMAKE_RUNTIME_OUTPUT_DIRECTORY) + QString::fromLocal8Bit("/kdesu_stub");
+        }
         group.writeEntry("kdesu_stub_path", kdesuStubPath);
         group.writeEntry("command", commandPath);
     }
@@ -61,6 +82,125 @@ private Q_SLOTS:
         QVERIFY(result2 == KDESu::SuProcess::SuIncorrectPassword);
     }
 
+    void sudoPamPrompt()
+    {
+        editConfig(QString::fromLocal8Bit("sudo"), QString::fromLocal8Bit(CMAKE_HOME_DIRECTORY) + QString::fromLocal8Bit("/autotests/sudo"));
+
+        // A prompt other than the sentinel passed with -p
+        qputenv("KDESU_TEST_PAM_PROMPT", "Password for jr@KDE.ORG: ");
+        auto unsetPrompt = qScopeGuard([] {
+            qunsetenv("KDESU_TEST_PAM_PROMPT");
+        });
+
+        KDESu::SuProcess suProcess("root", "ls");
+        QCOMPARE(suProcess.exec(MYPASSWORD, 0), 0);
+
+        KDESu::SuProcess asyncProcess("root", "ls");
+        KDESu::ExecJob job(&asyncProcess);
+        QFuture<int> future = job.start(MYPASSWORD);
+        QTRY_VERIFY_WITH_TIMEOUT(future.isFinished(), 10000);
+        QCOMPARE(future.result(), 0);
+    }
+
+    void sudoNeedPassword()
+    {
+        editConfig(QString::fromLocal8Bit("sudo"), QString::fromLocal8Bit(CMAKE_HOME_DIRECTORY) + QString::fromLocal8Bit("/autotests/sudo"));
+
+        KDESu::SuProcess suProcess("root", "ls");
+        QVERIFY(suProcess.checkNeedPassword() != 0);
+    }
+
+    void sudoNeedPasswordCached()
+    {
+        // Copies, to touch them
+        QTemporaryDir dir;
+        QVERIFY(dir.isValid());
+        const QString sudo = dir.filePath(QStringLiteral("sudo"));
+        const QString stub = dir.filePath(QStringLiteral("kdesu_stub"));
+        QVERIFY(QFile::copy(QString::fromLocal8Bit(CMAKE_HOME_DIRECTORY) + QString::fromLocal8Bit("/autotests/sudo"), sudo));
+        QVERIFY(QFile::copy(QString::fromLocal8Bit(CMAKE_RUNTIME_OUTPUT_DIRECTORY) + QString::fromLocal8Bit("/kdesu_stub"), stub));
+        editConfig(QString::fromLocal8Bit("sudo"), sudo, stub);
+
+        // The fake sudo logs every probe with -n
+        const QByteArray log = QFile::encodeName(dir.filePath(QStringLiteral("probes")));
+        qputenv("KDESU_TEST_PROBE_LOG", log);
+        qputenv("KDESU_CHECK_CACHE_TTL", "1000");
+        auto unsetVariables = qScopeGuard([] {
+            qunsetenv("KDESU_TEST_PROBE_LOG");
+            qunsetenv("KDESU_CHECK_CACHE_TTL");
+        });
+        const auto probes = [&log] {
+            return readFile(log).count('\n');
+        };
+        const auto touch = [](const QString &fileName) {
+            QFile file(fileName);
+            return file.open(QIODevice::ReadWrite) && file.setFileTime(QDateTime::currentDateTime().addSecs(60), QFileDevice::FileModificationTime);
+        };
+
+        KDESu::SuProcess suProcess("root", "ls");
+        QVERIFY(suProcess.checkNeedPassword() != 0);
+        QCOMPARE(probes(), 1);
+        QVERIFY(suProcess.checkNeedPassword() != 0);
+        KDESu::SuProcess otherProcess("root", "ls");
+        QVERIFY(otherProcess.checkNeedPassword() != 0);
+        QCOMPARE(probes(), 1);
+
+        // A new backend or stub might answer differently
+        QVERIFY(touch(sudo));
+        QVERIFY(suProcess.checkNeedPassword() != 0);
+        QCOMPARE(probes(), 2);
+        QVERIFY(touch(stub));
+        QVERIFY(suProcess.checkNeedPassword() != 0);
+        QCOMPARE(probes(), 3);
+        QVERIFY(suProcess.checkNeedPassword() != 0);
+        QCOMPARE(probes(), 3);
+
+        // After the lifetime
+        QTest::qSleep(1100);
+        QVERIFY(suProcess.checkNeedPassword() != 0);
+        QCOMPARE(probes(), 4);
+    }
+
+    void sudoGoodPasswordPooled()
+    {
+        editConfig(QString::fromLocal8Bit("sudo"), QString::fromLocal8Bit(CMAKE_HOME_DIRECTORY) + QString::fromLocal8Bit("/autotests/sudo"));
+
+        KDESu::PtyProcess::setPtyPoolSize(2);
+        auto disablePool = qScopeGuard([] {
+            KDESu::PtyProcess::setPtyPoolSize(0);
+        });
+        for (int i = 0; i < 3; ++i) {
+            KDESu::SuProcess suProcess("root", "ls");
+            QCOMPARE(suProcess.exec(MYPASSWORD, 0), 0);
+        }
+    }
+
+    void sudoGoodPasswordAsync()
+    {
+        editConfig(QString::fromLocal8Bit("sudo"), QString::fromLocal8Bit(CMAKE_HOME_DIRECTORY) + QString::fromLocal8Bit("/autotests/sudo"));
+
+        KDESu::SuProcess suProcess("root", "ls");
+        KDESu::ExecJob job(&suProcess);
+        QSignalSpy stateSpy(&job, &KDESu::ExecJob::stateChanged);
+        QSignalSpy finishedSpy(&job, &KDESu::ExecJob::finished);
+        QFuture<int> future = job.start(MYPASSWORD);
+        QVERIFY(finishedSpy.wait(10000));
+        QCOMPARE(future.result(), 0);
+        QCOMPARE(job.state(), KDESu::ExecJob::Finished);
+        QCOMPARE(stateSpy.first().at(0).value<KDESu::ExecJob::State>(), KDESu::ExecJob::Spawned);
+    }
+
+    void sudoBadPasswordAsync()
+    {
+        editConfig(QString::fromLocal8Bit("sudo"), QString::fromLocal8Bit(CMAKE_HOME_DIRECTORY) + QString::fromLocal8Bit("/autotests/sudo"));
+
+        KDESu::SuProcess suProcess("root", "ls");
+        KDESu::ExecJob job(&suProcess);
+        QFuture<int> future = job.start("broken");
+        QTRY_VERIFY_WITH_TIMEOUT(future.isFinished(), 10000);
+        QCOMPARE(future.result(), int(KDESu::SuProcess::SuIncorrectPassword));
+    }
+
     void doasBadPassword()
     {
         editConfig(QString::fromLocal8Bit("doas"), QString::fromLocal8Bit(CMAKE_HOME_DIRECTORY) + QString::fromLocal8Bit("/autotests/sudo"));
@@ -94,6 +234,289 @@ private Q_SLOTS:
         QVERIFY(result2 == 0);
     }
 
+    void stubProtocolV2()
+    {
+        editConfig(QString::fromLocal8Bit("su"), QString::fromLocal8Bit(CMAKE_HOME_DIRECTORY) + QString::fromLocal8Bit("/autotests/su"));
+
+        QTemporaryDir dir;
+        QVERIFY(dir.isValid());
+        const QByteArray argsFile = QFile::encodeName(dir.filePath(QStringLiteral("args")));
+        const QByteArray envFile = QFile::encodeName(dir.filePath(QStringLiteral("env")));
+
+        // The current user, so the stub doesn't have to switch users
+        KDESu::SuProcess suProcess(currentUser());
+        suProcess.setArguments({"sh",
+                                "-c",
+                                "printf '<%s>' \"$@\" > \"$0\"; printf %s \"$KDESU_TEST_A\" \"$KDESU_TEST_B\" > " + envFile,
+                                argsFile,
+                                "one",
+                                "",
+                                "two words",
+                                "end"});
+        suProcess.setEnvironment({"KDESU_TEST_A=a", "KDESU_TEST_B=b=c"});
+        QCOMPARE(suProcess.exec(ROOTPASSWORD, 0), 0);
+        QCOMPARE(readFile(argsFile), QByteArray("<one><><two words><end>"));
+        QCOMPARE(readFile(envFile), QByteArray("ab=c"));
+    }
+
+    void stubProtocolV1Fallback()
+    {
+        // A stub from before 6.28 asks for one parameter at a time
+        editConfig(QString::fromLocal8Bit("su"),
+                   QString::fromLocal8Bit(CMAKE_HOME_DIRECTORY) + QString::fromLocal8Bit("/autotests/su"),
+                   QString::fromLocal8Bit(CMAKE_HOME_DIRECTORY) + QString::fromLocal8Bit("/autotests/kdesu_stub_v1"));
+
+        QTemporaryDir dir;
+        QVERIFY(dir.isValid());
+        const QByteArray commandFile = QFile::encodeName(dir.filePath(QStringLiteral("command")));
+        const QByteArray argsFile = QFile::encodeName(dir.filePath(QStringLiteral("args")));
+
+        KDESu::SuProcess suProcess(currentUser(), "printf %s \"$KDESU_TEST_A\" > " + commandFile);
+        suProcess.setEnvironment({"KDESU_TEST_A=a\\b"});
+        QCOMPARE(suProcess.exec(ROOTPASSWORD, 0), 0);
+        QCOMPARE(readFile(commandFile), QByteArray("a\\b"));
+
+        // Arguments go through its shell, quoted
+        KDESu::SuProcess argsProcess(currentUser());
+        argsProcess.setArguments({"sh", "-c", "printf '<%s>' \"$@\" > \"$0\"", argsFile, "it's", "$HOME", "back\\slash"});
+        QCOMPARE(argsProcess.exec(ROOTPASSWORD, 0), 0);
+        QCOMPARE(readFile(argsFile), QByteArray("<it's><$HOME><back\\slash>"));
+    }
+
+    void stubLongValues()
+    {
+        // Around the 1024 byte lines and past the 8 KiB buffers of old stubs
+        for (const qsizetype size : {0, 1023, 1024, 1025, 3000, 20000}) {
+            QByteArray value;
+            for (qsizetype i = 0; i < size; ++i) {
+                value += char('a' + i % 26);
+            }
+            for (const qsizetype chunkSize : {1024, 100}) {
+                QByteArray output = runStub(stubParams("printf '<%s>' " + value), chunkSize);
+                QVERIFY(output.endsWith(QByteArray("end\n<" + value + '>')));
+                QCOMPARE(m_stubExitCode, 0);
+
+                output = runStub(stubParams("", echoArgumentAndEnvironment(value)), chunkSize);
+                QVERIFY(output.endsWith(QByteArray("end\n<" + value + "><" + value + '>')));
+                QCOMPARE(m_stubExitCode, 0);
+            }
+        }
+    }
+
+    void stubQuoting()
+    {
+        // Every byte but NUL, and what looks like it is quoted already
+        QByteArray value;
+        for (int c = 1; c < 256; ++c) {
+            value += char(c);
+        }
+        value += "\\/ \\J \\\\ \\";
+
+        const QByteArray output = runStub(stubParams("", echoArgumentAndEnvironment(value)));
+        QVERIFY(output.endsWith(QByteArray("end\n<" + value + "><" + value + '>')));
+        QCOMPARE(m_stubExitCode, 0);
+    }
+
+    void stubQuotingOverPty()
+    {
+        editConfig(QString::fromLocal8Bit("su"), QString::fromLocal8Bit(CMAKE_HOME_DIRECTORY) + QString::fromLocal8Bit("/autotests/su"));
+
+        QTemporaryDir dir;
+        QVERIFY(dir.isValid());
+        const QByteArray argFile = QFile::encodeName(dir.filePath(QStringLiteral("arg")));
+        const QByteArray envFile = QFile::encodeName(dir.filePath(QStringLiteral("env")));
+
+        // Unquoted, the terminal would act on the control characters, and
+        // drop lines longer than 4096 bytes
+        QByteArray value;
+        for (int c = 1; c < 256; ++c) {
+            value += char(c);
+        }
+        value += "\\/ \\J \\\\ \\";
+        value += QByteArray(5000, 'x');
+
+        KDESu::SuProcess suProcess(currentUser());
+        suProcess.setArguments({"sh", "-c", "printf %s \"$1\" > \"$0\"; printf %s \"$KDESU_TEST_A\" > " + envFile, argFile, value});
+        suProcess.setEnvironment({"KDESU_TEST_A=" + value});
+        QCOMPARE(suProcess.exec(ROOTPASSWORD, 0), 0);
+        QCOMPARE(readFile(argFile), value);
+        QCOMPARE(readFile(envFile), value);
+    }
+
+    void stubDeadlineWithX11()
+    {
+        // The stub forks to remove the Xauthority file, a deadline task can't
+        const QByteArray output = runStub(stubParams("true",
+                                                     {{"display", ":0"},
+                                                      {"display_auth", "MIT-MAGIC-COOKIE-1 00112233445566778899aabbccddeeff"},
+                                                      {"scheduler", "deadline 1000000 10000000 10000000"}}));
+        QVERIFY(output.contains("kdesu_stub: deadline scheduling not possible with X11"));
+        QVERIFY(!output.contains("end\n"));
+        QCOMPARE(m_stubExitCode, 1);
+    }
+
+    void stubWritesXauthority()
+    {
+        QTemporaryDir dir;
+        QVERIFY(dir.isValid());
+        const QByteArray copy = QFile::encodeName(dir.filePath(QStringLiteral("Xauthority")));
+
+        const QByteArray output = runStub(stubParams("cp \"$XAUTHORITY\" " + copy,
+                                                     {{"display", ":7.0"}, {"display_auth", "MIT-MAGIC-COOKIE-1 00112233445566778899aabbccddeeff"}}));
+        QVERIFY(output.endsWith("end\n"));
+        QCOMPARE(m_stubExitCode, 0);
+        // What "xauth add :7.0 MIT-MAGIC-COOKIE-1 0011..." writes
+        QCOMPARE(readFile(copy), xauthEntry(256, hostName(), "7", "MIT-MAGIC-COOKIE-1", QByteArray::fromHex("00112233445566778899aabbccddeeff")));
+
+#if HAVE_X11
+        // And it reads back the same
+        const auto restore = useXauthority(QFile::decodeName(copy), ":7.0");
+        KDESuPrivate::KCookie cookie;
+        QCOMPARE(cookie.displayAuth(), QByteArray("MIT-MAGIC-COOKIE-1 00112233445566778899aabbccddeeff"));
+#endif
+    }
+
+#ifdef Q_OS_LINUX
+    void stubCpuAffinity()
+    {
+        // One of the CPUs we may run on
+        cpu_set_t set;
+        QCOMPARE(sched_getaffinity(0, sizeof(set), &set), 0);
+        int cpu = 0;
+        while (!CPU_ISSET(cpu, &set)) {
+            cpu++;
+        }
+
+        QByteArray output = runStub(stubParams("grep Cpus_allowed_list /proc/self/status", {{"cpu_affinity", QByteArray::number(cpu)}}));
+        QVERIFY(output.endsWith(QByteArray("end\nCpus_allowed_list:\t" + QByteArray::number(cpu) + '\n')));
+        QCOMPARE(m_stubExitCode, 0);
+
+        // No such CPU, the command runs where it would have anyway
+        output = runStub(stubParams("true", {{"cpu_affinity", "1023"}}));
+        QVERIFY(output.contains("kdesu_stub: sched_setaffinity()"));
+        QCOMPARE(m_stubExitCode, 0);
+    }
+
+    void stubIoPriority_data()
+    {
+        QTest::addColumn<QByteArray>("ioPriority");
+        QTest::addColumn<QByteArray>("expected");
+
+        // Neither needs privileges
+        QTest::newRow("best-effort") << QByteArray("best-effort 6") << QByteArray("best-effort: prio 6");
+        QTest::newRow("idle") << QByteArray("idle") << QByteArray("idle");
+    }
+
+    void stubIoPriority()
+    {
+        QFETCH(QByteArray, ioPriority);
+        QFETCH(QByteArray, expected);
+
+        if (QStandardPaths::findExecutable(QStringLiteral("ionice")).isEmpty()) {
+            QSKIP("ionice not found");
+        }
+        const QByteArray output = runStub(stubParams("ionice -p $$", {{"io_priority", ioPriority}}));
+        QVERIFY(output.endsWith(QByteArray("end\n" + expected + '\n')));
+        QCOMPARE(m_stubExitCode, 0);
+    }
+
+    void stubOomScoreAdjust()
+    {
+        // Raising it needs no privileges
+        QByteArray output = runStub(stubParams("cat /proc/self/oom_score_adj", {{"oom_score_adj", "500"}}));
+        QVERIFY(output.endsWith("end\n500\n"));
+        QCOMPARE(m_stubExitCode, 0);
+
+        output = runStub(stubParams("true", {{"oom_score_adj", "2000"}}));
+        QVERIFY(output.contains("kdesu_stub: bad oom_score_adj 2000"));
+        QCOMPARE(m_stubExitCode, 0);
+    }
+
+    void stubBadCgroup_data()
+    {
+        QTest::addColumn<QByteArray>("cgroup");
+        QTest::addColumn<QByteArray>("error");
+
+        QTest::newRow("parent") << QByteArray("../kdesu") << QByteArray("kdesu_stub: bad cgroup ../kdesu\n");
+        QTest::newRow("parent in between") << QByteArray("/user.slice/../../kdesu") << QByteArray("kdesu_stub: bad cgroup user.slice/../../kdesu\n");
+        QTest::newRow("does not exist") << QByteArray("kdesutest-does-not-exist") << QByteArray("No such file or directory\n");
+    }
+
+    void stubBadCgroup()
+    {
+        QFETCH(QByteArray, cgroup);
+        QFETCH(QByteArray, error);
+
+        // The stub gives up before "end", the command never runs
+        const QByteArray output = runStub(stubParams("echo started", {{"cgroup", cgroup}}));
+        QVERIFY(output.startsWith("kdesu_stub\nparams\nkdesu_stub: "));
+        QVERIFY(output.endsWith(error));
+        QVERIFY(!output.contains("started"));
+        QCOMPARE(m_stubExitCode, 1);
+    }
+#endif
+
+    void suBadCgroup()
+    {
+        editConfig(QString::fromLocal8Bit("su"), QString::fromLocal8Bit(CMAKE_HOME_DIRECTORY) + QString::fromLocal8Bit("/autotests/su"));
+
+        QTemporaryDir dir;
+        QVERIFY(dir.isValid());
+        const QByteArray startedFile = QFile::encodeName(dir.filePath(QStringLiteral("started")));
+
+        // converseStubLine() takes the stub's error as a failure, not as
+        // a wrong password
+        KDESu::SuProcess suProcess(currentUser(), "touch " + startedFile);
+        suProcess.setCgroup("../kdesu");
+        QCOMPARE(suProcess.exec(ROOTPASSWORD, 0), -1);
+        QVERIFY(!QFile::exists(QFile::decodeName(startedFile)));
+        QVERIFY(suProcess.cgroupPath().isEmpty());
+    }
+
+    void kcookieXauthority_data()
+    {
+        QTest::addColumn<QByteArray>("display");
+        QTest::addColumn<QByteArray>("cookie");
+
+        // autotests/Xauthority has FamilyWild entries for :10 and :1, and
+        // FamilyLocal ones of another host for :1, :2 and :3. This host
+        // gets one for :2.
+        const QByteArray wild = "MIT-MAGIC-COOKIE-1 " + QByteArray(16, '\x22').toHex();
+        const QByteArray local = "MIT-MAGIC-COOKIE-1 " + QByteArray(16, '\x55').toHex();
+        QTest::newRow("FamilyWild") << QByteArray(":1") << wild;
+        QTest::newRow("screen") << QByteArray(":1.0") << wild;
+        QTest::newRow("unix") << QByteArray("unix:1") << wild;
+        QTest::newRow("localhost") << QByteArray("localhost:1") << wild;
+        QTest::newRow("FamilyLocal") << QByteArray(":2") << local;
+        QTest::newRow("two digits") << QByteArray(":10") << QByteArray("MIT-MAGIC-COOKIE-1 " + QByteArray(16, '\x44').toHex());
+        QTest::newRow("other host") << QByteArray(":3") << QByteArray();
+        QTest::newRow("no entry") << QByteArray(":4") << QByteArray();
+    }
+
+    void kcookieXauthority()
+    {
+#if HAVE_X11
+        QFETCH(QByteArray, display);
+        QFETCH(QByteArray, cookie);
+
+        QTemporaryDir dir;
+        QVERIFY(dir.isValid());
+        const QString path = dir.filePath(QStringLiteral("Xauthority"));
+        QVERIFY(QFile::copy(QString::fromLocal8Bit(CMAKE_HOME_DIRECTORY) + QLatin1String("/autotests/Xauthority"), path));
+        QFile file(path);
+        QVERIFY(file.open(QIODevice::Append));
+        file.write(xauthEntry(256, hostName(), "2", "MIT-MAGIC-COOKIE-1", QByteArray(16, '\x55')));
+        file.close();
+
+        const auto restore = useXauthority(path, display);
+        KDESuPrivate::KCookie kcookie;
+        QCOMPARE(kcookie.display(), display);
+        QCOMPARE(kcookie.displayAuth(), cookie);
+#else
+        QSKIP("Built without X11 support");
+#endif
+    }
+
     void suBadPassword()
     {
         editConfig(QString::fromLocal8Bit("su"), QString::fromLocal8Bit(CMAKE_HOME_DIRECTORY) + QString::fromLocal8Bit("/autotests/su"));
@@ -104,6 +527,160 @@ private Q_SLOTS:
         int result2 = suProcess.exec("broken", 0);
         QVERIFY(result2 == KDESu::SuProcess::SuIncorrectPassword);
     }
+
+private:
+    using StubParams = QList<std::pair<QByteArray, QByteArray>>;
+
+    static QByteArray currentUser()
+    {
+        return getpwuid(getuid())->pw_name;
+    }
+
+    static QByteArray readFile(const QByteArray &fileName)
+    {
+        QFile file(QFile::decodeName(fileName));
+        if (!file.open(QIODevice::ReadOnly)) {
+            return QByteArray();
+        }
+        return file.readAll();
+    }
+
+    static QByteArray hostName()
+    {
+        char hostname[256];
+        if (gethostname(hostname, sizeof(hostname)) < 0) {
+            return QByteArray();
+        }
+        hostname[sizeof(hostname) - 1] = '\0';
+        return hostname;
+    }
+
+    // Points KCookie at another Xauthority file and display, until the
+    // returned guard goes out of scope
+    static auto useXauthority(const QString &path, const QByteArray &display)
+    {
+        const auto saved = [](const char *name) {
+            return qEnvironmentVariableIsSet(name) ? std::optional<QByteArray>(qgetenv(name)) : std::nullopt;
+        };
+        const std::optional<QByteArray> oldXauthority = saved("XAUTHORITY");
+        const std::optional<QByteArray> oldDisplay = saved("DISPLAY");
+        qputenv("XAUTHORITY", QFile::encodeName(path));
+        qputenv("DISPLAY", display);
+        return qScopeGuard([oldXauthority, oldDisplay] {
+            const auto restore = [](const char *name, const std::optional<QByteArray> &value) {
+                if (value) {
+                    qputenv(name, *value);
+                } else {
+                    qunsetenv(name);
+                }
+            };
+            restore("XAUTHORITY", oldXauthority);
+            restore("DISPLAY", oldDisplay);
+        });
+    }
+
+    // An entry of an Xauthority file, numbers are 16 bit big endian
+    static QByteArray xauthEntry(quint16 family, const QByteArray &address, const QByteArray &number, const QByteArray &name, const QByteArray &data)
+    {
+        QByteArray entry;
+        const auto append16 = [&entry](qsizetype value) {
+            entry += char((value >> 8) & 0xff);
+            entry += char(value & 0xff);
+        };
+        append16(family);
+        for (const QByteArray &field : {address, number, name, data}) {
+            append16(field.size());
+            entry += field;
+        }
+        return entry;
+    }
+
+    // copy of the quoting in KDESu::StubProcess
+    static QByteArray quoteForStub(const QByteArray &str)
+    {
+        QByteArray quoted;
+        for (const uchar c : str) {
+            if (c < 32 || c == 127) {
+                quoted.append('\\');
+                quoted.append(char(c + '@'));
+            } else if (c == '\\') {
+                quoted.append("\\/");
+            } else {
+                quoted.append(c);
+            }
+        }
+        return quoted;
+    }
+
+    // The parameters StubProcess sends to run command, with extra ones
+    // added or replacing those of the same name
+    static StubParams stubParams(const QByteArray &command, const StubParams &extra = {})
+    {
+        StubParams params = {
+            {"display", "no"},
+            {"display_auth", ""},
+            {"command", command},
+            {"path", qgetenv("PATH")},
+            {"xwindows_only", "no"},
+            {"user", currentUser()},
+            {"priority", "50"},
+            {"scheduler", "normal"},
+            {"app_startup_id", "0"},
+        };
+        for (const auto &param : extra) {
+            auto it = std::find_if(params.begin(), params.end(), [&param](const auto &p) {
+                return p.first == param.first;
+            });
+            if (it != params.end() && param.first != "argv" && param.first != "environment") {
+                it->second = param.second;
+            } else {
+                params.append(param);
+            }
+        }
+        return params;
+    }
+
+    // Prints "<value>" from the arguments, then from the environment
+    static StubParams echoArgumentAndEnvironment(const QByteArray &value)
+    {
+        return {
+            {"argv", "sh"},
+            {"argv", "-c"},
+            {"argv", "printf '<%s>' \"$1\" \"$KDESU_TEST_A\""},
+            {"argv", "sh"},
+            {"argv", value},
+            {"environment", "KDESU_TEST_A=" + value},
+        };
+    }
+
+    // Talks version 2 of the protocol with kdesu_stub, like StubProcess,
+    // and returns all it printed
+    QByteArray runStub(const StubParams &params, qsizetype chunkSize = 1024)
+    {
+        QProcess stub;
+        stub.setProcessChannelMode(QProcess::MergedChannels);
+        stub.start(QString::fromLocal8Bit(CMAKE_RUNTIME_OUTPUT_DIRECTORY) + QLatin1String("/kdesu_stub"), QStringList());
+        if (!stub.waitForStarted()) {
+            return QByteArray();
+        }
+        // The answer to the header, then all parameters at once
+        QByteArray block = "ok 2\n";
+        for (const auto &[name, value] : params) {
+            const QByteArray quoted = quoteForStub(value);
+            block += name + ' ' + QByteArray::number(quoted.size()) + '\n';
+            for (qsizetype pos = 0; pos < quoted.size(); pos += chunkSize) {
+                block += quoted.mid(pos, chunkSize) + '\n';
+            }
+        }
+        block += '\n';
+        stub.write(block);
+        stub.closeWriteChannel();
+        stub.waitForFinished(10000);
+        m_stubExitCode = stub.exitCode();
+        return stub.readAll();
+    }
+
+    int m_stubExitCode = -1;
 };
 }
 
@@ -13,6 +13,7 @@
 #include <ksu_debug.h>
 
 #include <cerrno>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 
@@ -90,6 +91,8 @@ int Client::connect()
                            << "socket():" << strerror(errno);
         return -1;
     }
+    // Not for the su, sudo or ssh we start
+    fcntl(d->sockfd, F_SETFD, FD_CLOEXEC);
     struct sockaddr_un addr;
     addr.sun_family = AF_UNIX;
     strcpy(addr.sun_path, d->sock.constData());
@@ -188,16 +191,23 @@ int Client::command(const QByteArray &cmd, QByteArray *result)
         return -1;
     }
 
+    // Replies like the one of STAT can be longer than one recv(), read up
+    // to the newline so nothing is left for the next command.
+    QByteArray reply;
     char buf[1024];
-    int nbytes = recv(d->sockfd, buf, 1023, 0);
-    if (nbytes <= 0) {
-        qCWarning(KSU_LOG) << "[" << __FILE__ << ":" << __LINE__ << "] "
-                           << "no reply from daemon.";
-        return -1;
+    while (!reply.endsWith('\n')) {
+        int nbytes = recv(d->sockfd, buf, sizeof(buf), 0);
+        if (nbytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nbytes <= 0) {
+            qCWarning(KSU_LOG) << "[" << __FILE__ << ":" << __LINE__ << "] "
+                               << "no reply from daemon.";
+            return -1;
+        }
+        reply.append(buf, nbytes);
     }
-    buf[nbytes] = '\000';
 
-    QByteArray reply = buf;
     if (reply.left(2) != "OK") {
         return -1;
     }
@@ -237,6 +247,31 @@ int Client::exec(const QByteArray &prog, const QByteArray &user, const QByteArra
     return command(cmd);
 }
 
+int Client::exec(const QList<QByteArray> &arguments, const QByteArray &user, const QByteArray &options, const QList<QByteArray> &env)
+{
+    if (arguments.isEmpty()) {
+        return -1;
+    }
+
+    // The arguments apply to the next EXEC only, kdesud caches the
+    // password for them and just logs the command
+    if (setArguments(arguments) < 0) {
+        return -1;
+    }
+    return exec(arguments.join(' '), user, options, env);
+}
+
+int Client::setArguments(const QList<QByteArray> &arguments)
+{
+    QByteArray cmd = "ARGS";
+    for (const auto &arg : arguments) {
+        cmd += ' ';
+        cmd += escape(arg);
+    }
+    cmd += '\n';
+    return command(cmd);
+}
+
 int Client::setHost(const QByteArray &host)
 {
     QByteArray cmd = "HOST ";
@@ -263,6 +298,89 @@ int Client::setScheduler(int sched)
     return command(cmd);
 }
 
+int Client::setScheduler(int sched, qint64 runtime, qint64 deadline, qint64 period)
+{
+    QByteArray cmd;
+    cmd += "SCHD ";
+    cmd += QByteArray::number(sched);
+    cmd += ' ';
+    cmd += QByteArray::number(runtime);
+    cmd += ' ';
+    cmd += QByteArray::number(deadline);
+    cmd += ' ';
+    cmd += QByteArray::number(period);
+    cmd += '\n';
+    return command(cmd);
+}
+
+// "1,2,3", split again by kdesud
+static QByteArray joinNumbers(const QList<int> &numbers)
+{
+    QByteArray ret;
+    for (const int number : numbers) {
+        if (!ret.isEmpty()) {
+            ret += ',';
+        }
+        ret += QByteArray::number(number);
+    }
+    return ret;
+}
+
+int Client::setCpuAffinity(const QList<int> &cpus)
+{
+    QByteArray cmd = "AFFN ";
+    cmd += escape(joinNumbers(cpus));
+    cmd += '\n';
+    return command(cmd);
+}
+
+int Client::setNumaPolicy(int policy, const QList<int> &nodes)
+{
+    QByteArray cmd = "NUMA ";
+    cmd += QByteArray::number(policy);
+    cmd += ' ';
+    cmd += escape(joinNumbers(nodes));
+    cmd += '\n';
+    return command(cmd);
+}
+
+int Client::setIoPriority(int ioClass, int level)
+{
+    QByteArray cmd = "IOPR ";
+    cmd += QByteArray::number(ioClass);
+    cmd += ' ';
+    cmd += QByteArray::number(level);
+    cmd += '\n';
+    return command(cmd);
+}
+
+int Client::setOomScoreAdjust(int adjust)
+{
+    // Quoted, the lexer only knows positive numbers
+    QByteArray cmd = "OOMS ";
+    cmd += escape(QByteArray::number(adjust));
+    cmd += '\n';
+    return command(cmd);
+}
+
+int Client::setCgroup(const QByteArray &parent)
+{
+    QByteArray cmd = "CGRP ";
+    cmd += escape(parent);
+    cmd += '\n';
+    return command(cmd);
+}
+
+int Client::setCgroupLimit(int limit, const QByteArray &value)
+{
+    QByteArray cmd = "CGLM ";
+    cmd += QByteArray::number(limit);
+    cmd += ' ';
+    cmd += escape(value);
+    cmd += '\n';
+    return command(cmd);
+}
+
 int Client::delCommand(const QByteArray &key, const QByteArray &user)
 {
     QByteArray cmd = "DEL ";
@@ -272,6 +390,14 @@ int Client::delCommand(const QByteArray &key, const QByteArray &user)
     cmd += '\n';
     return command(cmd);
 }
+int Client::delCommand(const QList<QByteArray> &arguments, const QByteArray &user)
+{
+    if (arguments.isEmpty() || setArguments(arguments) < 0) {
+        return -1;
+    }
+    return delCommand(arguments.join(' '), user);
+}
+
 int Client::setVar(const QByteArray &key, const QByteArray &value, int timeout, const QByteArray &group)
 {
     QByteArray cmd = "SET ";
@@ -365,6 +491,25 @@ int Client::ping()
     return command("PING\n");
 }
 
+QMap<QByteArray, qint64> Client::stats()
+{
+    QMap<QByteArray, qint64> map;
+    QByteArray reply;
+    if (command("STAT\n", &reply) != 0) {
+        return map;
+    }
+
+    const QList<QByteArray> fields = reply.split(' ');
+    for (const QByteArray &field : fields) {
+        const int pos = field.indexOf('=');
+        if (pos <= 0) {
+            continue;
+        }
+        map.insert(field.left(pos), field.mid(pos + 1).toLongLong());
+    }
+    return map;
+}
+
 int Client::exitCode()
 {
     QByteArray result;
@@ -14,6 +14,7 @@
 
 #include <QByteArray>
 #include <QList>
+#include <QMap>
 #include <memory>
 
 #ifdef Q_OS_UNIX
@@ -73,6 +74,20 @@ public:
      */
     int exec(const QByteArray &command, const QByteArray &user, const QByteArray &options = nullptr, const QList<QByteArray> &env = QList<QByteArray>());
 
+    /*!
+     * Lets kdesud execute a command given as a list of \a arguments, run
+     * without a shell, see StubProcess::setArguments(). Otherwise the same
+     * as the exec() taking a command string. The password is cached for
+     * exactly these arguments, apart from command strings, see the
+     * delCommand() taking arguments.
+     *
+     * Returns Zero on success, -1 on failure, including when kdesud is too
+     * old to know argument lists.
+     *
+     * \since 6.28
+     */
+    int exec(const QList<QByteArray> &arguments, const QByteArray &user, const QByteArray &options = nullptr, const QList<QByteArray> &env = QList<QByteArray>());
+
     /*!
      * Wait for the last command to exit and return the exit code.
      *
@@ -106,6 +121,64 @@ public:
      */
     int setScheduler(int scheduler);
 
+    /*!
+     * Set the desired \a scheduler together with the \a runtime, \a deadline
+     * and \a period of StubProcess::SchedDeadline, see
+     * StubProcess::setDeadline().
+     *
+     * \since 6.28
+     */
+    int setScheduler(int scheduler, qint64 runtime, qint64 deadline, qint64 period);
+
+    /*!
+     * Set the CPUs the command may run on (optional), see
+     * StubProcess::setCpuAffinity().
+     *
+     * \since 6.28
+     */
+    int setCpuAffinity(const QList<int> &cpus);
+
+    /*!
+     * Set the memory policy of the command (optional), see
+     * StubProcess::setNumaPolicy().
+     *
+     * \since 6.28
+     */
+    int setNumaPolicy(int policy, const QList<int> &nodes);
+
+    /*!
+     * Set the I/O scheduling class and level of the command (optional),
+     * see StubProcess::setIoPriority().
+     *
+     * \since 6.28
+     */
+    int setIoPriority(int ioClass, int level);
+
+    /*!
+     * Set the oom_score_adj of the command (optional), see
+     * StubProcess::setOomScoreAdjust().
+     *
+     * \since 6.28
+     */
+    int setOomScoreAdjust(int adjust);
+
+    /*!
+     * Run the command in a new cgroup below \a parent (optional), see
+     * StubProcess::setCgroup(). The path of the new cgroup is not reported
+     * back through the daemon.
+     *
+     * \since 6.28
+     */
+    int setCgroup(const QByteArray &parent);
+
+    /*!
+     * Set \a limit of the cgroup to \a value (optional), see
+     * StubProcess::setCgroupLimit().
+     *
+     * \since 6.28
+     */
+    int setCgroupLimit(int limit, const QByteArray &value);
+
     /*!
      * Remove a password for a user/command.
      *
@@ -117,6 +190,16 @@ public:
      */
     int delCommand(const QByteArray &command, const QByteArray &user);
 
+    /*!
+     * Remove the password cached for running \a arguments as \a user with
+     * the exec() taking arguments.
+     *
+     * Return zero on success, -1 on an error
+     *
+     * \since 6.28
+     */
+    int delCommand(const QList<QByteArray> &arguments, const QByteArray &user);
+
     /*!
      * Set a persistent variable.
      *
@@ -202,6 +285,26 @@ public:
      */
     int ping();
 
+    /*!
+     * Query the usage counters of kdesud. This can be used for diagnostics
+     * and monitoring.
+     *
+     * The returned map contains, among others, the number of connections
+     * ("connections", "connections.active"), the number of commands
+     * received per type ("cmd.EXEC", "cmd.PASS", ...), the number and size
+     * of stored entries ("repo.entries", "repo.bytes"), the number of
+     * expired entries ("repo.expired"), password cache hits and misses of
+     * EXEC ("cache.hits", "cache.misses"), the number of running and
+     * finished EXEC children ("exec.running", "exec.finished") and a
+     * histogram of their fork-to-exit latency ("exec.latency.100ms",
+     * "exec.latency.1s", ..., "exec.latency.inf").
+     *
+     * Returns the counters by name, or an empty map on failure.
+     *
+     * \since 6.28
+     */
+    QMap<QByteArray, qint64> stats();
+
     /*!
      * Stop the daemon.
      */
@@ -217,6 +320,7 @@ private:
 
     KDESU_NO_EXPORT int command(const QByteArray &cmd, QByteArray *result = nullptr);
     KDESU_NO_EXPORT QByteArray escape(const QByteArray &str);
+    KDESU_NO_EXPORT int setArguments(const QList<QByteArray> &arguments);
 
 private:
     std::unique_ptr<class ClientPrivate> const d;
@@ -4,5 +4,11 @@
 #cmakedefine01 HAVE_X11
 #cmakedefine01 HAVE_INITGROUPS
 #cmakedefine01 HAVE_SYS_SELECT_H
+#cmakedefine01 HAVE_SYS_SDT_H
+#cmakedefine01 HAVE_PIDFD_OPEN
+#cmakedefine01 HAVE_VFORK
+#cmakedefine01 HAVE_CLOSE_RANGE
+#cmakedefine01 HAVE_POSIX_SPAWN_ADDCLOSEFROM
+#cmakedefine01 POSIX1B_SCHEDULING
 #define CMAKE_INSTALL_PREFIX "${CMAKE_INSTALL_PREFIX}"
 #define KDE_INSTALL_FULL_LIBEXECDIR_KF "${KDE_INSTALL_FULL_LIBEXECDIR_KF}"
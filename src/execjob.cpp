@@ -0,0 +1,509 @@
+/*
+    This file is part of the KDE project, module kdesu.
+    SPDX-FileCopyrightText: 2026 KDE Contributors
+
+    SPDX-License-Identifier: GPL-2.0-only
+
+    execjob.cpp: Event loop driven SuProcess / SshProcess::exec().
+*/
+
+#include "execjob.h"
+
+#include "kdesutrace_p.h"
+#include "sshprocess.h"
+#include "sshprocess_p.h"
+#include "suprocess.h"
+#include "suprocess_p.h"
+#include <ksu_debug.h>
+
+#include <cerrno>
+#include <cstring>
+#include <optional>
+#include <signal.h>
+#include <termios.h>
+#include <utility>
+
+#include <QElapsedTimer>
+#include <QPromise>
+#include <QSocketNotifier>
+#include <QTimer>
+
+namespace KDESu
+{
+class ExecJobPrivate
+{
+public:
+    ExecJobPrivate(ExecJob *q, StubProcess *process, SuProcess *su, SshProcess *ssh)
+        : q(q)
+        , process(process)
+        , su(su)
+        , ssh(ssh)
+    {
+    }
+
+    // What the output of the PTY is fed to
+    enum Phase {
+        Converse, // su or ssh, until the stub header shows up
+        Stub,
+        Child,
+        Reap, // the child has been killed, output is dropped
+        Restart, // sudo wants a PTY, start over once it has exited
+    };
+
+    StubProcessPrivate *ptyPrivate() const
+    {
+        return process->d_func();
+    }
+
+    void setState(ExecJob::State newState);
+    void finish(int result);
+    void readOutput();
+    void processInput();
+    void handleLine(const QByteArray &line);
+    void converse(const QByteArray &line);
+    void converseDone(int ret);
+    void stubDone(int ret);
+    void writePassword();
+    void wipePassword();
+    void watchChild();
+    int spawn();
+    void restart();
+    void killChild(int sig, int result);
+    void checkChild();
+
+    ExecJob *const q;
+    StubProcess *const process;
+    SuProcess *const su;
+    SshProcess *const ssh;
+
+    ExecJob::State state = ExecJob::NotStarted;
+    Phase phase = Converse;
+    QPromise<int> promise;
+    QFuture<int> future;
+    QByteArray password;
+
+    QSocketNotifier *outputNotifier = nullptr;
+    QSocketNotifier *exitNotifier = nullptr;
+    // Polls for the exit of the child where there is no pidfd
+    QTimer exitTimer;
+    // A line su might be waiting after, see SuProcess::converseSU()
+    QByteArray promptLine;
+    QTimer promptTimer;
+    // Only the start of the sentinel prompt of sudo has been read
+    bool partialPrompt = false;
+    // Waiting for the slave to turn off ECHO before writing the password
+    bool waitingForSlave = false;
+    QTimer slaveTimer;
+    QElapsedTimer slaveWait;
+    // The result once the killed child has been reaped
+    std::optional<int> killResult;
+
+    QElapsedTimer total;
+    QElapsedTimer phaseTimer;
+};
+
+void ExecJobPrivate::setState(ExecJob::State newState)
+{
+    state = newState;
+    Q_EMIT q->stateChanged(newState);
+}
+
+void ExecJobPrivate::finish(int result)
+{
+    PtyProcessPrivate *pd = ptyPrivate();
+
+    if (phase == Child) {
+        pd->timings.child = phaseTimer.nsecsElapsed();
+    }
+    pd->finishTimings(total, su ? su->d_func()->superUserCommand.toLatin1().constData() : "ssh");
+
+    // Might be called from one of the notifiers
+    if (outputNotifier) {
+        outputNotifier->setEnabled(false);
+        outputNotifier->deleteLater();
+        outputNotifier = nullptr;
+    }
+    if (exitNotifier) {
+        exitNotifier->setEnabled(false);
+        exitNotifier->deleteLater();
+        exitNotifier = nullptr;
+    }
+    exitTimer.stop();
+    promptTimer.stop();
+    slaveTimer.stop();
+    wipePassword();
+
+    promise.addResult(result);
+    promise.finish();
+    setState(ExecJob::Finished);
+    Q_EMIT q->finished(result);
+}
+
+void ExecJobPrivate::readOutput()
+{
+    PtyProcessPrivate *pd = ptyPrivate();
+
+    const int ret = pd->readInput(false);
+    if (ret > 0) {
+        partialPrompt = false;
+    }
+    if (ret > 0 && !promptLine.isNull()) {
+        // More output, so the line su printed was no prompt after all
+        promptTimer.stop();
+        promptLine = QByteArray();
+    }
+    if (ret < 0) {
+        // Nobody has the slave open anymore
+        outputNotifier->setEnabled(false);
+    }
+
+    if (waitingForSlave) {
+        writePassword();
+    }
+    processInput();
+
+    if (ret < 0 && (phase == Converse || phase == Stub) && state != ExecJob::Finished) {
+        handleLine(QByteArray());
+    }
+}
+
+/*
+ * Hand out the buffered output according to the phase, like the blocking
+ * readLine() loops of exec() would.
+ */
+void ExecJobPrivate::processInput()
+{
+    PtyProcessPrivate *pd = ptyPrivate();
+
+    while (pd->pendingInput() > 0 && state != ExecJob::Finished) {
+        if (phase == Child) {
+            process->handleChildOutput(process->readAll(false));
+        } else if (phase == Reap || phase == Restart) {
+            process->readAll(false);
+        } else if (waitingForSlave || partialPrompt || !promptLine.isNull()) {
+            return;
+        } else {
+            handleLine(process->readLine(false));
+        }
+    }
+}
+
+void ExecJobPrivate::handleLine(const QByteArray &line)
+{
+    if (phase == Stub) {
+        const int ret = process->converseStubLine(line, SuProcess::NoCheck);
+        if (ret != ConverseContinue) {
+            stubDone(ret);
+        }
+        return;
+    }
+
+    if (su && su->d_func()->converseState == SuProcessPrivate::WaitForPrompt && !line.isNull() && line != "kdesu_stub") {
+        if (su->isPartialSentinel(line)) {
+            // Wait for the rest of the prompt
+            process->unreadLine(line, false);
+            partialPrompt = true;
+            return;
+        }
+        if (su->isSentinel(line)) {
+            converse(line);
+            return;
+        }
+        // PAM modules may replace the sentinel with their own prompt
+        if (ptyPrivate()->pendingInput() > 0) {
+            // There is more output available, so this line couldn't have
+            // been a password prompt.
+            return;
+        }
+        // Only a prompt if su waits for input after it
+        promptLine = line;
+        promptTimer.start(100);
+        return;
+    }
+
+    converse(line);
+}
+
+void ExecJobPrivate::converse(const QByteArray &line)
+{
+    const int ret = su ? su->converseSULine(line, !password.isNull()) : ssh->converseSshLine(line, 0);
+    if (ret == ConverseContinue) {
+        return;
+    }
+    if (ret == ConverseWritePassword) {
+        setState(ExecJob::Prompt);
+        waitingForSlave = true;
+        slaveWait.start();
+        writePassword();
+        return;
+    }
+    converseDone(ret);
+}
+
+/*
+ * Like waitSlave(), but without blocking. In packet mode the termios change
+ * wakes up the output notifier, otherwise we check again after 10 ms.
+ */
+void ExecJobPrivate::writePassword()
+{
+    PtyProcessPrivate *pd = ptyPrivate();
+
+    struct termios tio;
+    if (!pd->pty) {
+        // sudo -S reads the password from its stdin, nothing to wait for
+        tio.c_lflag = 0;
+    } else if (!pd->pty->tcGetAttr(&tio)) {
+        qCCritical(KSU_LOG) << "[" << __FILE__ << ":" << __LINE__ << "] "
+                            << "tcgetattr():" << strerror(errno);
+        waitingForSlave = false;
+        converseDone(-1);
+        return;
+    }
+    if (tio.c_lflag & ECHO) {
+        // The timeout is only a safety net in packet mode
+        slaveTimer.start(pd->packetMode ? 1000 : 10);
+        return;
+    }
+
+    slaveTimer.stop();
+    waitingForSlave = false;
+    pd->disablePacketMode();
+    pd->timings.waitSlave = slaveWait.nsecsElapsed();
+    process->writeLine(password);
+    KDESU_TRACE1(password_written, process->pid());
+    wipePassword();
+}
+
+void ExecJobPrivate::wipePassword()
+{
+    if (!password.isEmpty()) {
+        memset(password.data(), 0, password.size());
+    }
+    password.clear();
+}
+
+void ExecJobPrivate::converseDone(int ret)
+{
+    PtyProcessPrivate *pd = ptyPrivate();
+    pd->timings.prompt = phaseTimer.nsecsElapsed();
+    pd->disablePacketMode();
+
+    if (ret < 0 && su && su->d_func()->ttyRequired) {
+        // sudo is configured with requiretty, start over on a PTY once
+        // it has exited
+        phase = Restart;
+        watchChild();
+        return;
+    }
+
+    // Both su and ssh return -1 on errors
+    if (ret < 0) {
+        qCCritical(KSU_LOG) << "[" << __FILE__ << ":" << __LINE__ << "] "
+                            << "Conversation with" << (su ? su->d_func()->superUserCommand : QStringLiteral("ssh")) << "failed.";
+        finish(ret);
+        return;
+    }
+    if (su && ret != 0) {
+        killChild(SIGKILL, SuProcess::SuIncorrectPassword);
+        return;
+    }
+
+    wipePassword();
+    phase = Stub;
+    phaseTimer.start();
+    setState(ExecJob::Authenticated);
+}
+
+void ExecJobPrivate::stubDone(int ret)
+{
+    PtyProcessPrivate *pd = ptyPrivate();
+    pd->timings.stub = phaseTimer.nsecsElapsed();
+
+    if (ret < 0) {
+        qCCritical(KSU_LOG) << "[" << __FILE__ << ":" << __LINE__ << "] "
+                            << "Conversation with kdesu_stub failed.";
+        finish(ret);
+        return;
+    }
+    if (ret == 1) {
+        if (su) {
+            killChild(SIGKILL, SuProcess::SuIncorrectPassword);
+        } else {
+            killChild(SIGTERM, SshProcess::SshIncorrectPassword);
+        }
+        return;
+    }
+
+    if (su) {
+        su->d_func()->authenticated();
+    } else {
+        process->setExitString("Waiting for forwarded connections to terminate");
+    }
+    pd->exitRemainder.clear();
+    phase = Child;
+    phaseTimer.start();
+    setState(ExecJob::Running);
+    watchChild();
+}
+
+int ExecJobPrivate::spawn()
+{
+    // Restarting might happen from the notifier of the previous run
+    if (outputNotifier) {
+        outputNotifier->setEnabled(false);
+        outputNotifier->deleteLater();
+        outputNotifier = nullptr;
+    }
+    partialPrompt = false;
+
+    const int ret = su ? su->start(SuProcess::NoCheck) : ssh->start(0);
+    if (ret) {
+        return ret;
+    }
+
+    if (su) {
+        su->d_func()->converseState = SuProcessPrivate::WaitForPrompt;
+    } else {
+        ssh->d_func()->converseState = 0;
+    }
+    ptyPrivate()->stubHeaderSeen = false;
+    ptyPrivate()->cgroupPath.clear();
+    setState(ExecJob::Spawned);
+
+    outputNotifier = new QSocketNotifier(process->fd(), QSocketNotifier::Read, q);
+    QObject::connect(outputNotifier, &QSocketNotifier::activated, q, [this] {
+        readOutput();
+    });
+    return 0;
+}
+
+void ExecJobPrivate::restart()
+{
+    // The notifier and the timer watched the previous child
+    if (exitNotifier) {
+        exitNotifier->setEnabled(false);
+        exitNotifier->deleteLater();
+        exitNotifier = nullptr;
+    }
+    exitTimer.stop();
+
+    phase = Converse;
+    phaseTimer.start();
+    if (const int ret = spawn()) {
+        finish(ret);
+    }
+}
+
+void ExecJobPrivate::killChild(int sig, int result)
+{
+    kill(process->pid(), sig);
+    ptyPrivate()->closeInput();
+    killResult = result;
+    phase = Reap;
+    watchChild();
+}
+
+/*
+ * Like waitForChild(): a pidfd of the child tells when it has exited,
+ * otherwise we check every 100 ms.
+ */
+void ExecJobPrivate::watchChild()
+{
+    PtyProcessPrivate *pd = ptyPrivate();
+
+    if (!exitNotifier && pd->pidFd >= 0) {
+        exitNotifier = new QSocketNotifier(pd->pidFd, QSocketNotifier::Read, q);
+        QObject::connect(exitNotifier, &QSocketNotifier::activated, q, [this] {
+            checkChild();
+        });
+    } else if (pd->pidFd < 0 && !exitTimer.isActive()) {
+        exitTimer.start(100);
+    }
+    checkChild();
+}
+
+void ExecJobPrivate::checkChild()
+{
+    const int ret = process->reapChild();
+    if (ret == PtyProcess::NotExited) {
+        return;
+    }
+    if (phase == Restart) {
+        restart();
+        return;
+    }
+
+    // Pass on what the child wrote last
+    if (ptyPrivate()->readInput(false) >= 0) {
+        processInput();
+    }
+    finish(killResult.value_or(ret));
+}
+
+ExecJob::ExecJob(SuProcess *process, QObject *parent)
+    : QObject(parent)
+    , d(new ExecJobPrivate(this, process, process, nullptr))
+{
+}
+
+ExecJob::ExecJob(SshProcess *process, QObject *parent)
+    : QObject(parent)
+    , d(new ExecJobPrivate(this, process, nullptr, process))
+{
+}
+
+ExecJob::~ExecJob()
+{
+    d->wipePassword();
+}
+
+QFuture<int> ExecJob::start(const QByteArray &password)
+{
+    if (d->state != NotStarted) {
+        qCWarning(KSU_LOG) << "ExecJob::start() called twice.";
+        return d->future;
+    }
+
+    d->future = d->promise.future();
+    d->promise.start();
+    d->password = password;
+
+    d->total.start();
+    d->phaseTimer.start();
+    d->ptyPrivate()->resetTimings();
+
+    d->promptTimer.setSingleShot(true);
+    connect(&d->promptTimer, &QTimer::timeout, this, [this] {
+        d->converse(std::exchange(d->promptLine, QByteArray()));
+        d->processInput();
+    });
+    d->slaveTimer.setSingleShot(true);
+    connect(&d->slaveTimer, &QTimer::timeout, this, [this] {
+        if (d->waitingForSlave) {
+            d->writePassword();
+            d->processInput();
+        }
+    });
+    connect(&d->exitTimer, &QTimer::timeout, this, [this] {
+        d->checkChild();
+    });
+
+    if (const int ret = d->spawn()) {
+        d->finish(ret);
+    }
+    return d->future;
+}
+
+ExecJob::State ExecJob::state() const
+{
+    return d->state;
+}
+
+QFuture<int> ExecJob::future() const
+{
+    return d->future;
+}
+
+} // namespace KDESu
+
+#include "moc_execjob.cpp"
@@ -0,0 +1,130 @@
+/*
+    This file is part of the KDE project, module kdesu.
+    SPDX-FileCopyrightText: 2026 KDE Contributors
+
+    SPDX-License-Identifier: GPL-2.0-only
+*/
+
+#ifndef KDESUEXECJOB_H
+#define KDESUEXECJOB_H
+
+#include <kdesu/kdesu_export.h>
+
+#include <QByteArray>
+#include <QFuture>
+#include <QObject>
+
+#include <memory>
+
+namespace KDESu
+{
+class ExecJobPrivate;
+class SshProcess;
+class SuProcess;
+
+/*!
+ * \class KDESu::ExecJob
+ * \inmodule KDESu
+ * \inheaderfile KDESu/ExecJob
+ *
+ * \brief Runs a command through SuProcess or SshProcess without blocking.
+ *
+ * ExecJob does the same as SuProcess::exec() or SshProcess::exec() in
+ * NoCheck mode, driven by the event loop instead of blocking the calling
+ * thread. The PTY and the exit of the child are watched with socket
+ * notifiers, so one thread can run any number of jobs.
+ *
+ * \code
+ * auto process = new KDESu::SuProcess("root", "command");
+ * auto job = new KDESu::ExecJob(process, this);
+ * connect(job, &KDESu::ExecJob::finished, this, [process](int result) {
+ *     delete process;
+ * });
+ * job->start(password);
+ * \endcode
+ *
+ * The process must stay alive until the job has finished. Destroying an
+ * unfinished job cancels the future, but leaves the command running.
+ *
+ * Password checks with SuProcess::checkInstall() and
+ * SuProcess::checkNeedPassword() remain synchronous.
+ *
+ * \since 6.28
+ */
+class KDESU_EXPORT ExecJob : public QObject
+{
+    Q_OBJECT
+
+public:
+    /*!
+     * \value NotStarted start() has not been called yet
+     * \value Spawned The su or ssh command has been started
+     * \value Prompt The password prompt has been answered
+     * \value Authenticated kdesu_stub is running, parameters are being passed
+     * \value Running The command is running
+     * \value Finished The job is done, see finished()
+     */
+    enum State {
+        NotStarted,
+        Spawned,
+        Prompt,
+        Authenticated,
+        Running,
+        Finished,
+    };
+    Q_ENUM(State)
+
+    /*!
+     * Creates a job running \a process, which is not owned by the job.
+     */
+    explicit ExecJob(SuProcess *process, QObject *parent = nullptr);
+
+    /*!
+     * Creates a job running \a process, which is not owned by the job.
+     */
+    explicit ExecJob(SshProcess *process, QObject *parent = nullptr);
+
+    ~ExecJob() override;
+
+    /*!
+     * Starts the command, answering the password prompt with \a password.
+     * A null \a password makes the job fail if a password is asked for.
+     *
+     * The job keeps its own copy of the password and overwrites it as soon
+     * as it has been used.
+     *
+     * Returns a future for the result, which is the same value exec()
+     * returns. It is also passed to finished().
+     */
+    QFuture<int> start(const QByteArray &password);
+
+    /*!
+     * Returns the current state of the job.
+     */
+    State state() const;
+
+    /*!
+     * Returns a future for the result of the job.
+     */
+    QFuture<int> future() const;
+
+Q_SIGNALS:
+    /*!
+     * Emitted whenever the job enters a new \a state.
+     */
+    void stateChanged(KDESu::ExecJob::State state);
+
+    /*!
+     * Emitted once the job is done, with the same \a result that exec()
+     * returns.
+     */
+    void finished(int result);
+
+private:
+    friend class ExecJobPrivate;
+    std::unique_ptr<ExecJobPrivate> const d;
+};
+
+}
+
+#endif // KDESUEXECJOB_H
@@ -11,11 +11,21 @@
 
 #include <ksu_debug.h>
 
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QMutex>
 #include <QProcess>
 #include <QStandardPaths>
 #include <QString>
 #include <QStringList>
 
+#include <future>
+
+#include <unistd.h>
+
 extern int kdesuDebugArea();
 
 namespace KDESu
@@ -29,26 +39,58 @@ public:
 #if HAVE_X11
     QByteArray displayAuth;
 #endif
+    // The lookup started by fetch()
+    std::future<void> pending;
+    bool fetched = false;
 };
 
 KCookie::KCookie()
     : d(new KCookiePrivate)
 {
+}
+
+KCookie::~KCookie()
+{
+    if (d->pending.valid()) {
+        d->pending.wait();
+    }
+}
+
+void KCookie::fetch()
+{
 #if HAVE_X11
-    getXCookie();
+    if (d->fetched) {
+        return;
+    }
+    d->fetched = true;
+    d->pending = std::async(std::launch::async, [this] {
+        getXCookie();
+    });
 #endif
 }
 
-KCookie::~KCookie() = default;
+void KCookie::waitForFetch() const
+{
+#if HAVE_X11
+    if (!d->fetched) {
+        d->fetched = true;
+        const_cast<KCookie *>(this)->getXCookie();
+    } else if (d->pending.valid()) {
+        d->pending.get();
+    }
+#endif
+}
 
 QByteArray KCookie::display() const
 {
+    waitForFetch();
     return d->display;
 }
 
 #if HAVE_X11
 QByteArray KCookie::displayAuth() const
 {
+    waitForFetch();
     return d->displayAuth;
 }
 #endif
@@ -79,11 +121,127 @@ void KCookie::getXCookie()
         disp.remove(0, 9);
     }
 
+    if (disp.startsWith(':') || disp.startsWith("unix:")) { // krazy:exclude=strings
+        d->displayAuth = readXCookie(disp);
+        if (d->displayAuth.isEmpty()) {
+            qCWarning(KSU_LOG) << "No X authentication info set for display" << d->display;
+        }
+    } else {
+        // Remote displays need the address resolution of xauth
+        d->displayAuth = runXauth(disp);
+    }
+#endif
+}
+
+#if HAVE_X11
+namespace
+{
+// Cookies read by readXCookie(), by Xauthority file and display
+struct CookieCache {
+    struct Entry {
+        QDateTime modified;
+        QByteArray cookie;
+    };
+    QMutex mutex;
+    QHash<QString, Entry> entries;
+};
+}
+
+Q_GLOBAL_STATIC(CookieCache, s_cookieCache)
+
+/*
+ * Reads the cookie "xauth list" would print for the local display @p disp from
+ * $XAUTHORITY or ~/.Xauthority. The file is a sequence of records: a 16 bit
+ * family, followed by the address, the display number, the name and the
+ * data, each prefixed with its 16 bit length, everything big endian.
+ * Returns "name hexdata", or nothing if no entry matches.
+ */
+QByteArray KCookie::readXCookie(const QByteArray &disp) const
+{
+    static const quint16 familyLocal = 256;
+    static const quint16 familyWild = 65535;
+
+    QByteArray number = disp.mid(disp.indexOf(':') + 1);
+    // Without the screen
+    const qsizetype dot = number.indexOf('.');
+    if (dot >= 0) {
+        number.truncate(dot);
+    }
+
+    QString path = qEnvironmentVariable("XAUTHORITY");
+    if (path.isEmpty()) {
+        path = QDir::homePath() + QLatin1String("/.Xauthority");
+    }
+    const QDateTime modified = QFileInfo(path).lastModified();
+    const QString key = path + QLatin1Char('\0') + QString::fromLatin1(number);
+
+    QMutexLocker locker(&s_cookieCache->mutex);
+    const auto it = s_cookieCache->entries.constFind(key);
+    if (it != s_cookieCache->entries.cend() && it->modified == modified) {
+        return it->cookie;
+    }
+
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return QByteArray();
+    }
+    const QByteArray data = file.readAll();
+
+    char hostname[256];
+    if (gethostname(hostname, sizeof(hostname)) < 0) {
+        hostname[0] = '\0';
+    }
+    hostname[sizeof(hostname) - 1] = '\0';
+
+    QByteArray cookie;
+    qsizetype pos = 0;
+    const auto read16 = [&data, &pos](quint16 *value) {
+        if (pos + 2 > data.size()) {
+            return false;
+        }
+        *value = (uchar(data[pos]) << 8) | uchar(data[pos + 1]);
+        pos += 2;
+        return true;
+    };
+    const auto readField = [&data, &pos, &read16](QByteArrayView *field) {
+        quint16 len;
+        if (!read16(&len) || pos + len > data.size()) {
+            return false;
+        }
+        *field = QByteArrayView(data).sliced(pos, len);
+        pos += len;
+        return true;
+    };
+    while (pos < data.size()) {
+        quint16 family;
+        QByteArrayView address;
+        QByteArrayView displayNumber;
+        QByteArrayView name;
+        QByteArrayView authData;
+        if (!read16(&family) || !readField(&address) || !readField(&displayNumber) || !readField(&name) || !readField(&authData)) {
+            qCWarning(KSU_LOG) << "Truncated Xauthority file" << path;
+            break;
+        }
+        if (displayNumber != number) {
+            continue;
+        }
+        if (family == familyWild || (family == familyLocal && address == QByteArrayView(hostname))) {
+            cookie = name.toByteArray() + ' ' + authData.toByteArray().toHex();
+            break;
+        }
+    }
+
+    s_cookieCache->entries.insert(key, {modified, cookie});
+    return cookie;
+}
+
+QByteArray KCookie::runXauth(const QByteArray &disp) const
+{
     const QString xauthExec = QStandardPaths::findExecutable(QStringLiteral("xauth"));
     if (xauthExec.isEmpty()) {
         qCCritical(KSU_LOG) << "[" << __FILE__ << ":" << __LINE__ << "] "
                             << "Could not run xauth, not found in path";
-        return;
+        return QByteArray();
     }
 
     QProcess proc;
@@ -91,26 +249,26 @@ void KCookie::getXCookie()
     if (!proc.waitForStarted()) {
         qCCritical(KSU_LOG) << "[" << __FILE__ << ":" << __LINE__ << "] "
                             << "Could not run xauth. Found in path:" << xauthExec;
-        return;
+        return QByteArray();
     }
     proc.waitForReadyRead(100);
 
     QByteArray output = proc.readLine().simplified();
     if (output.isEmpty()) {
         qCWarning(KSU_LOG) << "No X authentication info set for display" << d->display;
-        return;
+        return QByteArray();
     }
 
     QList<QByteArray> lst = output.split(' ');
     if (lst.count() != 3) {
         qCCritical(KSU_LOG) << "[" << __FILE__ << ":" << __LINE__ << "] "
                             << "parse error.";
-        return;
+        return QByteArray();
     }
-    d->displayAuth = (lst[1] + ' ' + lst[2]);
     proc.waitForFinished(100); // give QProcess a chance to clean up gracefully
-#endif
+    return lst[1] + ' ' + lst[2];
 }
+#endif
 
 } // namespace KDESuPrivate
 } // namespace KDESu
@@ -21,6 +21,9 @@ namespace KDESuPrivate
 /*!
  * Utility class to access the authentication tokens needed to run a KDE
  * program (X11 cookies on X11, for instance).
+ *
+ * The tokens are looked up when first asked for, or in the background
+ * after fetch().
  * \internal
  */
 class KCookie
@@ -32,6 +35,12 @@ public:
     KCookie(const KCookie &) = delete;
     KCookie &operator=(const KCookie &) = delete;
 
+    /*!
+     * Starts looking up the tokens in a separate thread, unless that has
+     * been done already.
+     */
+    void fetch();
+
     /*!
      * Returns the X11 display.
      */
@@ -45,7 +54,12 @@ public:
 #endif
 
 private:
+    void waitForFetch() const;
     void getXCookie();
+#if HAVE_X11
+    QByteArray readXCookie(const QByteArray &disp) const;
+    QByteArray runXauth(const QByteArray &disp) const;
+#endif
 
 private:
     std::unique_ptr<class KCookiePrivate> const d;
@@ -21,13 +21,54 @@
     - build_sycoca    Rebuild sycoca?     "yes" | "no"
     - user            Target user         string
     - priority        Process priority    0 <= int <= 100
-    - scheduler       Process scheduler   "fifo" | "normal"
+    - scheduler       Process scheduler   "realtime" | "roundrobin" | "batch" |
+                                          "idle" | "normal" |
+                                          "deadline <runtime> <deadline> <period>"
     - app_startup_id  DESKTOP_STARTUP_ID  string
     - environment     Additional envvars  strings, last one is empty
+
+    The peer answers the header with "ok <version>" if it knows a newer
+    protocol. From version 2 on, the stub then asks for "params" once and
+    reads all parameters as "name <length>" lines, each followed by the
+    value, and the environment as "environment <length>" entries. An empty
+    line ends the list. Values are quoted like the command, <length> is
+    that of the quoted value, and the value is split into lines of at most
+    1024 bytes, since the terminal limits the length of a line. Unknown
+    names are ignored.
+
+    Version 2 has one more parameter, which may be repeated:
+
+    - argv            Command argument    string, runs the command directly
+                                          instead of through sh -c
+
+    and optional ones, which are left alone when empty or not sent:
+
+    - cpu_affinity    CPUs to run on      csl of CPU numbers
+    - numa_policy     Memory placement    "bind" | "interleave" | "preferred",
+                                          a space and a csl of nodes
+    - io_priority     I/O scheduling      "realtime <level>" |
+                                          "best-effort <level>" | "idle"
+    - oom_score_adj   OOM killer score    -1000 <= int <= 1000
+    - cgroup          Parent cgroup       path in the cgroup v2 hierarchy
+    - cgroup_cpu_max  Limits of the       "cpu.max", "memory.max",
+    - cgroup_memory_max  cgroup           "io.max" and "pids.max" in the
+    - cgroup_io_max                       format of the kernel, io.max
+    - cgroup_pids_max                     one device per line
+
+    With a cgroup, the stub creates the child cgroup kdesu-<pid> under it,
+    sets the limits, moves itself there and reports "cgroup <path>" before
+    "end". The cgroup is left in place, so its usage can be read after the
+    command has exited.
 */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* cpu_set_t, SCHED_BATCH */
+#endif
+
 #include <config-kdesu.h>
 
+#include "kdesutrace_p.h"
+
 #include <errno.h>
 #include <pwd.h>
 #include <signal.h>
@@ -47,10 +88,33 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 
-#ifdef POSIX1B_SCHEDULING
+#if POSIX1B_SCHEDULING
 #include <sched.h>
 #endif
 
+#ifdef __linux__
+#include <stdint.h>
+#include <sys/syscall.h>
+
+#include <sched.h>
+
+/* From linux/mempolicy.h */
+#define KDESU_MPOL_PREFERRED 1
+#define KDESU_MPOL_BIND 2
+#define KDESU_MPOL_INTERLEAVE 3
+
+/* From linux/ioprio.h */
+#define KDESU_IOPRIO_WHO_PROCESS 1
+#define KDESU_IOPRIO_CLASS_SHIFT 13
+#define KDESU_IOPRIO_CLASS_RT 1
+#define KDESU_IOPRIO_CLASS_BE 2
+#define KDESU_IOPRIO_CLASS_IDLE 3
+
+#include <fcntl.h>
+#include <limits.h>
+
+#endif
+
 /*!
  * Params sent by the peer.
  */
@@ -70,7 +134,17 @@ struct param_struct params[] = {{"kdesu_stub", 0L},
                                 {"priority", 0L},
                                 {"scheduler", 0L},
                                 /* obsoleted by app_startup_id    { "app_start_pid", 0L } */
-                                {"app_startup_id", 0L}};
+                                {"app_startup_id", 0L},
+                                /* optional, version 2 only */
+                                {"cpu_affinity", 0L},
+                                {"numa_policy", 0L},
+                                {"io_priority", 0L},
+                                {"oom_score_adj", 0L},
+                                {"cgroup", 0L},
+                                {"cgroup_cpu_max", 0L},
+                                {"cgroup_memory_max", 0L},
+                                {"cgroup_io_max", 0L},
+                                {"cgroup_pids_max", 0L}};
 
 #define P_HEADER 0
 #define P_DISPLAY 1
@@ -83,6 +157,20 @@ struct param_struct params[] = {{"kdesu_stub", 0L},
 #define P_SCHEDULER 8
 #define P_APP_STARTUP_ID 9
 #define P_LAST 10
+#define P_CPU_AFFINITY 10
+#define P_NUMA_POLICY 11
+#define P_IO_PRIORITY 12
+#define P_OOM_SCORE_ADJ 13
+#define P_CGROUP 14
+#define P_CGROUP_CPU_MAX 15
+#define P_CGROUP_MEMORY_MAX 16
+#define P_CGROUP_IO_MAX 17
+#define P_CGROUP_PIDS_MAX 18
+#define P_ALL 19
+
+/* The "argv" parameters, null terminated */
+static char **command_argv = 0L;
+static int command_argc = 0;
 
 /*!
  * Safe malloc functions.
@@ -130,7 +218,7 @@ char *xstrdup(char *src)
     int len = strlen(src);
     char *dst = xmalloc(len + 1);
     strcpy(dst, src);
-    if (dst[len - 1] == '\n') {
+    if (len > 0 && dst[len - 1] == '\n') {
         dst[len - 1] = '\000';
     }
     return dst;
@@ -161,8 +249,6 @@ char **xstrsep(char *str)
     return list;
 }
 
-#define BUFSIZE 8192
-
 static void dequote(char *buf)
 {
     char *in;
@@ -183,13 +269,548 @@ static void dequote(char *buf)
     *out = 0;
 }
 
+/*!
+ * Read a line from the peer, without the newline, give up if there is
+ * none. The line is overwritten by the next call.
+ */
+static char *read_line(size_t *length)
+{
+    static char *line = 0L;
+    static size_t size = 0;
+    ssize_t len = getline(&line, &size, stdin);
+    if (len < 0) {
+        printf("end\n");
+        fflush(stdout);
+        perror("kdesu_stub: getline()");
+        exit(1);
+    }
+    if (len > 0 && line[len - 1] == '\n') {
+        line[--len] = '\0';
+    }
+    if (length) {
+        *length = len;
+    }
+    return line;
+}
+
+/*!
+ * Read a value of protocol version 2: @p length quoted bytes, split into
+ * lines to stay below the line limit of the terminal.
+ */
+static char *read_value(size_t length)
+{
+    char *value = xmalloc(length + 1);
+    size_t pos = 0;
+    size_t len;
+    char *line;
+    while (pos < length) {
+        line = read_line(&len);
+        if (len > length - pos) {
+            fprintf(stderr, "kdesu_stub: value too long\n");
+            exit(1);
+        }
+        memcpy(value + pos, line, len);
+        pos += len;
+    }
+    value[length] = '\0';
+    dequote(value);
+    return value;
+}
+
+/*!
+ * Protocol version 2: ask for all parameters and the environment at once.
+ */
+static void read_params(void)
+{
+    int i;
+    char *line;
+    char *value;
+    char *end;
+    unsigned long length;
+
+    printf("params\n");
+    fflush(stdout);
+    for (;;) {
+        line = read_line(0L);
+        if (line[0] == '\0') { /* terminator */
+            break;
+        }
+        value = strchr(line, ' ');
+        if (value == 0L) {
+            continue;
+        }
+        *value++ = '\0';
+        errno = 0;
+        length = strtoul(value, &end, 10);
+        if (errno || *end || end == value) {
+            fprintf(stderr, "kdesu_stub: bad length for %s\n", line);
+            exit(1);
+        }
+        /* The name is overwritten when reading the value */
+        for (i = 1; i < P_ALL; i++) {
+            if (!strcmp(line, params[i].name)) {
+                break;
+            }
+        }
+        if (!strcmp(line, "environment")) {
+            putenv(read_value(length));
+        } else if (!strcmp(line, "argv")) {
+            command_argv = xrealloc(command_argv, (command_argc + 2) * sizeof(char *));
+            command_argv[command_argc++] = read_value(length);
+            command_argv[command_argc] = 0L;
+        } else if (i < P_ALL) {
+            free(params[i].value);
+            params[i].value = read_value(length);
+            KDESU_TRACE2(stub_param, params[i].name, params[i].value);
+        } else {
+            free(read_value(length));
+        }
+    }
+
+    for (i = 1; i < P_LAST; i++) {
+        if (params[i].value == 0L) {
+            printf("end\n");
+            fflush(stdout);
+            fprintf(stderr, "kdesu_stub: missing parameter %s\n", params[i].name);
+            exit(1);
+        }
+    }
+}
+
+#if POSIX1B_SCHEDULING
+/*!
+ * Switch to a realtime policy, with prio mapped to its priority range.
+ */
+static void set_realtime(int policy, int prio)
+{
+    struct sched_param sched;
+    int min = sched_get_priority_min(policy);
+    int max = sched_get_priority_max(policy);
+    sched.sched_priority = min + (int)(((double)prio) * (max - min) / 100 + 0.5);
+    if (sched_setscheduler(0, policy, &sched) < 0) {
+        perror("kdesu_stub: sched_setscheduler()");
+    }
+}
+#endif
+
+#if defined(__linux__) && defined(SYS_sched_setattr)
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE 6
+#endif
+
+/* From linux/sched/types.h, glibc only has it since 2.41 */
+struct kdesu_sched_attr {
+    uint32_t size;
+    uint32_t sched_policy;
+    uint64_t sched_flags;
+    int32_t sched_nice;
+    uint32_t sched_priority;
+    uint64_t sched_runtime;
+    uint64_t sched_deadline;
+    uint64_t sched_period;
+};
+
+/*!
+ * Switch to SCHED_DEADLINE, value is "deadline <runtime> <deadline> <period>"
+ * in nanoseconds. Returns -1 if that failed.
+ */
+static int set_deadline(const char *value)
+{
+    unsigned long long runtime;
+    unsigned long long deadline;
+    unsigned long long period;
+    struct kdesu_sched_attr attr;
+
+    if (sscanf(value, "deadline %llu %llu %llu", &runtime, &deadline, &period) != 3) {
+        fprintf(stderr, "kdesu_stub: bad deadline parameters\n");
+        return -1;
+    }
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.sched_policy = SCHED_DEADLINE;
+    attr.sched_runtime = runtime;
+    attr.sched_deadline = deadline;
+    attr.sched_period = period;
+    if (syscall(SYS_sched_setattr, 0, &attr, 0) < 0) {
+        perror("kdesu_stub: sched_setattr()");
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+#ifdef __linux__
+/*!
+ * Pin to the CPUs in the comma separated list.
+ */
+static void set_cpu_affinity(char *cpus)
+{
+    cpu_set_t set;
+    char **list = xstrsep(cpus);
+    int i;
+
+    CPU_ZERO(&set);
+    for (i = 0; list[i]; i++) {
+        int cpu = atoi(list[i]);
+        if (cpu >= 0 && cpu < CPU_SETSIZE) {
+            CPU_SET(cpu, &set);
+        }
+    }
+    free(list);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        perror("kdesu_stub: sched_setaffinity()");
+    }
+}
+
+/*!
+ * Set the memory policy, value is the policy, a space and the comma
+ * separated list of nodes.
+ */
+static void set_numa_policy(char *value)
+{
+    unsigned long mask[1024 / (8 * sizeof(unsigned long))];
+    const size_t bits = 8 * sizeof(mask);
+    char *nodes = strchr(value, ' ');
+    char **list;
+    int mode;
+    int i;
+
+    if (nodes == 0L) {
+        fprintf(stderr, "kdesu_stub: bad numa_policy\n");
+        return;
+    }
+    *nodes++ = '\0';
+    if (!strcmp(value, "bind")) {
+        mode = KDESU_MPOL_BIND;
+    } else if (!strcmp(value, "interleave")) {
+        mode = KDESU_MPOL_INTERLEAVE;
+    } else if (!strcmp(value, "preferred")) {
+        mode = KDESU_MPOL_PREFERRED;
+    } else {
+        fprintf(stderr, "kdesu_stub: unknown memory policy %s\n", value);
+        return;
+    }
+
+    memset(mask, 0, sizeof(mask));
+    list = xstrsep(nodes);
+    for (i = 0; list[i]; i++) {
+        int node = atoi(list[i]);
+        if (node >= 0 && (size_t)node < bits) {
+            mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+        }
+    }
+    free(list);
+    /* Kept across fork() and exec() */
+    if (syscall(SYS_set_mempolicy, mode, mask, bits + 1) < 0) {
+        perror("kdesu_stub: set_mempolicy()");
+    }
+}
+
+/*!
+ * Set the I/O class, value is the class and for realtime and best-effort
+ * a space and the level.
+ */
+static void set_io_priority(char *value)
+{
+    char *level = strchr(value, ' ');
+    int ioclass;
+    int data = 0;
+
+    if (level) {
+        *level++ = '\0';
+        data = atoi(level);
+        if (data < 0 || data > 7) {
+            data = 4;
+        }
+    }
+    if (!strcmp(value, "realtime")) {
+        ioclass = KDESU_IOPRIO_CLASS_RT;
+    } else if (!strcmp(value, "best-effort")) {
+        ioclass = KDESU_IOPRIO_CLASS_BE;
+    } else if (!strcmp(value, "idle")) {
+        ioclass = KDESU_IOPRIO_CLASS_IDLE;
+        data = 0;
+    } else {
+        fprintf(stderr, "kdesu_stub: unknown I/O class %s\n", value);
+        return;
+    }
+    /* Inherited by the children of the command */
+    if (syscall(SYS_ioprio_set, KDESU_IOPRIO_WHO_PROCESS, 0, (ioclass << KDESU_IOPRIO_CLASS_SHIFT) | data) < 0) {
+        perror("kdesu_stub: ioprio_set()");
+    }
+}
+
+/*!
+ * Adjust the badness the OOM killer gives the command. Lowering it needs
+ * CAP_SYS_RESOURCE, so do this before dropping privileges.
+ */
+static void set_oom_score_adj(const char *value)
+{
+    int adj = atoi(value);
+    FILE *f;
+
+    if (adj < -1000 || adj > 1000) {
+        fprintf(stderr, "kdesu_stub: bad oom_score_adj %s\n", value);
+        return;
+    }
+    f = fopen("/proc/self/oom_score_adj", "w");
+    if (f == 0L) {
+        perror("kdesu_stub: /proc/self/oom_score_adj");
+        return;
+    }
+    fprintf(f, "%d", adj);
+    if (fclose(f) != 0) {
+        perror("kdesu_stub: oom_score_adj");
+    }
+}
+
+/*!
+ * Write value to the interface file of the cgroup in dir.
+ */
+static int write_cgroup_file(const char *dir, const char *file, const char *value)
+{
+    char path[PATH_MAX];
+    size_t len = strlen(value);
+    int fd;
+
+    if (snprintf(path, sizeof(path), "%s/%s", dir, file) >= (int)sizeof(path)) {
+        fprintf(stderr, "kdesu_stub: cgroup path too long\n");
+        return -1;
+    }
+    fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "kdesu_stub: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (write(fd, value, len) != (ssize_t)len) {
+        fprintf(stderr, "kdesu_stub: %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/*!
+ * The cgroup v2 hierarchy, which systemd mounts on "unified" in its hybrid
+ * layout.
+ */
+static const char *cgroup_root(void)
+{
+    if (access("/sys/fs/cgroup/cgroup.controllers", F_OK) < 0 && access("/sys/fs/cgroup/unified/cgroup.controllers", F_OK) == 0) {
+        return "/sys/fs/cgroup/unified";
+    }
+    return "/sys/fs/cgroup";
+}
+
+/* The limits, with the controller each needs */
+static const struct {
+    int param;
+    const char *file;
+    const char *controller;
+} cgroup_limits[] = {{P_CGROUP_CPU_MAX, "cpu.max", "+cpu"},
+                     {P_CGROUP_MEMORY_MAX, "memory.max", "+memory"},
+                     {P_CGROUP_IO_MAX, "io.max", "+io"},
+                     {P_CGROUP_PIDS_MAX, "pids.max", "+pids"}};
+
+/*!
+ * Create the cgroup kdesu-<pid> below parent, set its limits and move the
+ * stub into it. Returns its path relative to the cgroup root, or 0L.
+ */
+static char *enter_cgroup(const char *parent)
+{
+    char dir[PATH_MAX];
+    char child[PATH_MAX];
+    char pid[32];
+    const char *root = cgroup_root();
+    const char *p;
+    size_t i;
+
+    while (*parent == '/') {
+        parent++;
+    }
+    /* Stay below the cgroup root */
+    for (p = parent; (p = strstr(p, "..")) != 0L; p += 2) {
+        if ((p == parent || p[-1] == '/') && (p[2] == '\0' || p[2] == '/')) {
+            fprintf(stderr, "kdesu_stub: bad cgroup %s\n", parent);
+            return 0L;
+        }
+    }
+    if (snprintf(dir, sizeof(dir), "%s%s%s", root, parent[0] ? "/" : "", parent) >= (int)sizeof(dir)
+        || snprintf(child, sizeof(child), "%s/kdesu-%d", dir, (int)getpid()) >= (int)sizeof(child)) {
+        fprintf(stderr, "kdesu_stub: cgroup path too long\n");
+        return 0L;
+    }
+
+    /* The parent hands the controllers down to its children */
+    for (i = 0; i < sizeof(cgroup_limits) / sizeof(cgroup_limits[0]); i++) {
+        const char *value = params[cgroup_limits[i].param].value;
+        if (value && value[0] && write_cgroup_file(dir, "cgroup.subtree_control", cgroup_limits[i].controller) < 0) {
+            return 0L;
+        }
+    }
+    if (mkdir(child, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "kdesu_stub: %s: %s\n", child, strerror(errno));
+        return 0L;
+    }
+    for (i = 0; i < sizeof(cgroup_limits) / sizeof(cgroup_limits[0]); i++) {
+        char *value = params[cgroup_limits[i].param].value;
+        char *line;
+        char *next;
+        if (value == 0L || value[0] == '\0') {
+            continue;
+        }
+        /* The kernel takes one device of io.max per write */
+        for (line = value; line; line = next) {
+            next = strchr(line, '\n');
+            if (next) {
+                *next++ = '\0';
+            }
+            if (line[0] && write_cgroup_file(child, cgroup_limits[i].file, line) < 0) {
+                return 0L;
+            }
+        }
+    }
+    snprintf(pid, sizeof(pid), "%d", (int)getpid());
+    if (write_cgroup_file(child, "cgroup.procs", pid) < 0) {
+        return 0L;
+    }
+    return xstrdup(child + strlen(root));
+}
+#endif
+
+/*!
+ * Xauthority files store numbers as 16 bit big endian.
+ */
+static void write_u16(FILE *f, size_t value)
+{
+    putc((value >> 8) & 0xff, f);
+    putc(value & 0xff, f);
+}
+
+static void write_field(FILE *f, const void *data, size_t len)
+{
+    write_u16(f, len);
+    fwrite(data, 1, len, f);
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/*!
+ * Write the entry "xauth add disp auth" would to the Xauthority file fd:
+ * family, address, display number, name and data. Only local displays
+ * are handled, as FamilyLocal with the host name as address. Returns -1
+ * without touching fd for anything else, for xauth to deal with.
+ */
+static int write_xauth(int fd, const char *disp, const char *auth)
+{
+    const unsigned short family_local = 256;
+    char hostname[256];
+    const char *number;
+    size_t number_len;
+    const char *hex;
+    size_t data_len;
+    unsigned char *data;
+    size_t i;
+    FILE *f;
+
+    if (disp[0] == ':') {
+        number = disp + 1;
+    } else if (!strncmp(disp, "unix:", 5)) {
+        number = disp + 5;
+    } else {
+        return -1;
+    }
+    /* Without the screen */
+    number_len = strspn(number, "0123456789");
+    if (number_len == 0 || (number[number_len] && number[number_len] != '.')) {
+        return -1;
+    }
+
+    /* "name hexdata" */
+    hex = strchr(auth, ' ');
+    if (hex == 0L || hex == auth || strlen(hex + 1) % 2) {
+        return -1;
+    }
+    data_len = strlen(hex + 1) / 2;
+    data = (unsigned char *)xmalloc(data_len + 1);
+    for (i = 0; i < data_len; i++) {
+        int high = hex_value(hex[1 + 2 * i]);
+        int low = hex_value(hex[2 + 2 * i]);
+        if (high < 0 || low < 0) {
+            free(data);
+            return -1;
+        }
+        data[i] = (high << 4) | low;
+    }
+
+    if (gethostname(hostname, sizeof(hostname)) < 0) {
+        free(data);
+        return -1;
+    }
+    hostname[sizeof(hostname) - 1] = '\0';
+
+    f = fdopen(fd, "w");
+    if (f == 0L) {
+        perror("kdesu_stub: fdopen()");
+        exit(1);
+    }
+    write_u16(f, family_local);
+    write_field(f, hostname, strlen(hostname));
+    write_field(f, number, number_len);
+    write_field(f, auth, hex - auth);
+    write_field(f, data, data_len);
+    memset(data, 0, data_len);
+    free(data);
+    if (fclose(f) != 0) {
+        perror("kdesu_stub: write(xauthority)");
+        exit(1);
+    }
+    return 0;
+}
+
+/*!
+ * Replace this process with the command, in a session of its own. Returns
+ * if there is no new session: setsid() fails with EPERM if su made us a
+ * process group leader, only a child of ours can start one then.
+ */
+static void exec_command(void)
+{
+    if (setsid() == -1) {
+        if (errno == EPERM) {
+            return;
+        }
+        perror("kdesu_stub: setsid()");
+        _exit(1);
+    }
+    KDESU_TRACE1(stub_exec, params[P_COMMAND].value);
+    if (command_argc > 0) {
+        execvp(command_argv[0], command_argv);
+    } else {
+        execl("/bin/sh", "sh", "-c", params[P_COMMAND].value, (void *)0);
+    }
+    perror("kdesu_stub: exec()");
+    _exit(1);
+}
+
 /*!
  * The main program
  */
 
 int main()
 {
-    char buf[BUFSIZE + 1];
     char xauthority[200];
     int i;
     int prio;
@@ -197,6 +818,7 @@ int main()
     FILE *fout;
     struct passwd *pw;
     const char *kdesu_lc_all;
+    const char *scheduler;
 
     xauthority[0] = '\0';
 
@@ -205,35 +827,58 @@ int main()
     for (i = 0; i < P_LAST; i++) {
         printf("%s\n", params[i].name);
         fflush(stdout);
-        if (fgets(buf, BUFSIZE, stdin) == 0L) {
-            printf("end\n");
-            fflush(stdout);
-            perror("kdesu_stub: fgets()");
-            exit(1);
-        }
-        params[i].value = xstrdup(buf);
+        params[i].value = xstrdup(read_line(0L));
+        KDESU_TRACE2(stub_param, params[i].name, params[i].value);
         /* Installation check? */
         if (i == 0 && !strcmp(params[i].value, "stop")) {
             printf("end\n");
             exit(0);
         }
+        /* Everything else in one go? */
+        if (i == 0 && !strncmp(params[i].value, "ok ", 3) && atoi(params[i].value + 3) >= 2) {
+            read_params();
+            break;
+        }
     }
-    printf("environment\n");
-    fflush(stdout);
-    for (;;) {
-        char *tmp;
-        if (fgets(buf, BUFSIZE, stdin) == 0L) {
-            printf("end\n");
-            fflush(stdout);
-            perror("kdesu_stub: fgets()");
-            exit(1);
+    if (i == P_LAST) {
+        /* Only the command is quoted in version 1 */
+        dequote(params[P_COMMAND].value);
+        printf("environment\n");
+        fflush(stdout);
+        for (;;) {
+            char *tmp = xstrdup(read_line(0L));
+            if (tmp[0] == '\0') { /* terminator */
+                break;
+            }
+            dequote(tmp);
+            putenv(tmp);
         }
-        dequote(buf);
-        tmp = xstrdup(buf);
-        if (tmp[0] == '\0') { /* terminator */
-            break;
+    }
+
+    /*
+     * A deadline task can't fork, but the stub has to, to remove the
+     * Xauthority file afterwards. Rather than running the command with a
+     * scheduler that was not asked for, refuse.
+     */
+    if (!strncmp(params[P_SCHEDULER].value, "deadline", 8) && strcmp(params[P_DISPLAY].value, "no") && params[P_DISPLAY_AUTH].value[0]) {
+        fprintf(stderr, "kdesu_stub: deadline scheduling not possible with X11 authentication\n");
+        exit(1);
+    }
+
+    /* Enter the cgroup before anything is started */
+
+    if (params[P_CGROUP].value && params[P_CGROUP].value[0]) {
+#ifdef __linux__
+        char *cgroup = enter_cgroup(params[P_CGROUP].value);
+        if (cgroup == 0L) {
+            exit(1);
         }
-        putenv(tmp);
+        printf("cgroup %s\n", cgroup);
+        free(cgroup);
+#else
+        fprintf(stderr, "kdesu_stub: cgroups not supported\n");
+        exit(1);
+#endif
     }
 
     printf("end\n");
@@ -263,26 +908,75 @@ int main()
     /* New user won't be able to connect it anyway. */
     unsetenv("DBUS_SESSION_BUS_ADDRESS");
 
+    /* Set CPU and memory placement, the affinity can't change under SCHED_DEADLINE */
+
+    if (params[P_CPU_AFFINITY].value && params[P_CPU_AFFINITY].value[0]) {
+#ifdef __linux__
+        set_cpu_affinity(params[P_CPU_AFFINITY].value);
+#else
+        printf("kdesu_stub: CPU affinity not supported\n");
+#endif
+    }
+    if (params[P_NUMA_POLICY].value && params[P_NUMA_POLICY].value[0]) {
+#ifdef __linux__
+        set_numa_policy(params[P_NUMA_POLICY].value);
+#else
+        printf("kdesu_stub: NUMA policy not supported\n");
+#endif
+    }
+
     /* Set scheduling/priority */
 
     prio = atoi(params[P_PRIORITY].value);
-    if (!strcmp(params[P_SCHEDULER].value, "realtime")) {
-#ifdef POSIX1B_SCHEDULING
-        struct sched_param sched;
-        int min = sched_get_priority_min(SCHED_FIFO);
-        int max = sched_get_priority_max(SCHED_FIFO);
-        sched.sched_priority = min + (int)(((double)prio) * (max - min) / 100 + 0.5);
-        sched_setscheduler(0, SCHED_FIFO, &sched);
+    scheduler = params[P_SCHEDULER].value;
+    if (!strcmp(scheduler, "realtime") || !strcmp(scheduler, "roundrobin")) {
+#if POSIX1B_SCHEDULING
+        set_realtime(strcmp(scheduler, "realtime") ? SCHED_RR : SCHED_FIFO, prio);
 #else
         printf("kdesu_stub: realtime scheduling not supported\n");
+#endif
+    } else if (!strncmp(scheduler, "deadline", 8)) {
+#if defined(__linux__) && defined(SYS_sched_setattr)
+        if (set_deadline(scheduler) < 0) {
+            exit(1);
+        }
+#else
+        printf("kdesu_stub: deadline scheduling not supported\n");
 #endif
     } else {
+#if POSIX1B_SCHEDULING && defined(SCHED_BATCH) && defined(SCHED_IDLE)
+        if (!strcmp(scheduler, "batch") || !strcmp(scheduler, "idle")) {
+            struct sched_param sched;
+            sched.sched_priority = 0;
+            if (sched_setscheduler(0, strcmp(scheduler, "idle") ? SCHED_BATCH : SCHED_IDLE, &sched) < 0) {
+                perror("kdesu_stub: sched_setscheduler()");
+            }
+        }
+#endif
+        /* SCHED_BATCH honours the nice value as well */
 #if HAVE_SETPRIORITY
         int val = 20 - (int)(((double)prio) * 40 / 100 + 0.5);
         setpriority(PRIO_PROCESS, getpid(), val);
 #endif
     }
 
+    /* Set I/O priority and OOM score */
+
+    if (params[P_IO_PRIORITY].value && params[P_IO_PRIORITY].value[0]) {
+#ifdef __linux__
+        set_io_priority(params[P_IO_PRIORITY].value);
+#else
+        printf("kdesu_stub: I/O priority not supported\n");
+#endif
+    }
+    if (params[P_OOM_SCORE_ADJ].value && params[P_OOM_SCORE_ADJ].value[0]) {
+#ifdef __linux__
+        set_oom_score_adj(params[P_OOM_SCORE_ADJ].value);
+#else
+        printf("kdesu_stub: oom_score_adj not supported\n");
+#endif
+    }
+
     /* Drop privileges (this is permanent) */
 
     if (getuid() != pw->pw_uid) {
@@ -327,18 +1021,20 @@ int main()
             if (fd2 == -1) {
                 perror("kdesu_stub: mkstemp()");
                 exit(1);
-            } else {
-                close(fd2);
             }
             xsetenv("XAUTHORITY", xauthority);
 
-            fout = popen("xauth >/dev/null 2>&1", "w");
-            if (fout == NULL) {
-                perror("kdesu_stub: popen(xauth)");
-                exit(1);
+            /* Without spawning a shell and xauth, if possible */
+            if (write_xauth(fd2, disp, params[P_DISPLAY_AUTH].value) < 0) {
+                close(fd2);
+                fout = popen("xauth >/dev/null 2>&1", "w");
+                if (fout == NULL) {
+                    perror("kdesu_stub: popen(xauth)");
+                    exit(1);
+                }
+                fprintf(fout, "add %s %s\n", disp, params[P_DISPLAY_AUTH].value);
+                pclose(fout);
             }
-            fprintf(fout, "add %s %s\n", disp, params[P_DISPLAY_AUTH].value);
-            pclose(fout);
         }
     }
 
@@ -350,6 +1046,12 @@ int main()
 
     /* Execute the command */
 
+    if (!*xauthority) {
+        /* Nothing to clean up afterwards, so don't stay around. */
+        exec_command();
+        /* Otherwise fall back to a child, like with an xauthority file. */
+    }
+
     pid = fork();
     if (pid == -1) {
         perror("kdesu_stub: fork()");
@@ -381,12 +1083,10 @@ int main()
         }
         exit(xit);
     } else {
-        setsid();
         /* Child: exec command. */
-        sprintf(buf, "%s", params[P_COMMAND].value);
-        dequote(buf);
-        execl("/bin/sh", "sh", "-c", buf, (void *)0);
-        perror("kdesu_stub: exec()");
+        exec_command();
+        /* A child is never a process group leader. */
+        perror("kdesu_stub: setsid()");
         _exit(1);
     }
 }
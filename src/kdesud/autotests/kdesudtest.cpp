@@ -9,7 +9,14 @@
 #include <QObject>
 #include <QTest>
 
+#include <utility>
+
+#include <suprocess.h>
+
+#include "../launch.h"
 #include "../lexer.h"
+#include "../repo.h"
+#include "../stats.h"
 
 namespace KDESu
 {
@@ -65,6 +72,251 @@ private Q_SLOTS:
 
         QVERIFY(l.lex() == '\n');
     }
+
+    void argsCommand()
+    {
+        // Process command like in KDESu::Client::exec with arguments
+        QByteArray cmd = "ARGS ";
+        cmd += escape("printf");
+        cmd += ' ';
+        cmd += escape("%s \"\\n\"");
+        cmd += '\n';
+
+        Lexer l(cmd);
+        QVERIFY(l.lex() == Lexer::Tok_args);
+
+        QVERIFY(l.lex() == Lexer::Tok_str);
+        QVERIFY(l.lval() == "printf");
+
+        QVERIFY(l.lex() == Lexer::Tok_str);
+        QVERIFY(l.lval() == "%s \"\\n\"");
+
+        QVERIFY(l.lex() == '\n');
+    }
+
+    void statCommand()
+    {
+        // Process command like in KDESu::Client::stats
+        Lexer l("STAT\n");
+        QVERIFY(l.lex() == Lexer::Tok_stat);
+        QVERIFY(l.lex() == '\n');
+    }
+
+    void statistics()
+    {
+        Statistics stats;
+        Repository repo;
+        Data_entry entry;
+        entry.value = "value";
+        entry.timeout = 60;
+        repo.add("key", entry);
+
+        stats.connectionOpened();
+        stats.connectionOpened();
+        stats.commandReceived(Lexer::Tok_pass);
+        stats.commandReceived(Lexer::Tok_exec);
+        stats.commandReceived(Lexer::Tok_exec);
+        stats.commandReceived(Lexer::Tok_str);
+        stats.cacheLookup(true);
+        stats.cacheLookup(false);
+        stats.cacheLookup(false);
+        stats.entriesExpired(3);
+        stats.execStarted(1000);
+        stats.execStarted(1001);
+        stats.execFinished(1000);
+        // Not started by us
+        stats.execFinished(1002);
+        stats.connectionClosed();
+
+        const QByteArray report = stats.report(repo);
+        QVERIFY(!report.contains('\n'));
+        const QMap<QByteArray, QByteArray> values = parseReport(report);
+        QCOMPARE(values.value("connections"), QByteArray("2"));
+        QCOMPARE(values.value("connections.active"), QByteArray("1"));
+        QCOMPARE(values.value("cmd.PASS"), QByteArray("1"));
+        QCOMPARE(values.value("cmd.EXEC"), QByteArray("2"));
+        QCOMPARE(values.value("cmd.other"), QByteArray("1"));
+        QVERIFY(!values.contains("cmd.STAT"));
+        QCOMPARE(values.value("repo.entries"), QByteArray("1"));
+        QCOMPARE(values.value("repo.expired"), QByteArray("3"));
+        QCOMPARE(values.value("cache.hits"), QByteArray("1"));
+        QCOMPARE(values.value("cache.misses"), QByteArray("2"));
+        QCOMPARE(values.value("exec.running"), QByteArray("1"));
+        QCOMPARE(values.value("exec.finished"), QByteArray("1"));
+        // Reaped right away, so in the first bucket
+        QCOMPARE(values.value("exec.latency.100ms"), QByteArray("1"));
+        for (const char *bucket : {"1s", "10s", "1m", "10m", "inf"}) {
+            QCOMPARE(values.value(QByteArray("exec.latency.") + bucket), QByteArray("0"));
+        }
+
+        // Closing more connections than were opened does not wrap around
+        stats.connectionClosed();
+        stats.connectionClosed();
+        QCOMPARE(parseReport(stats.report(repo)).value("connections.active"), QByteArray("0"));
+    }
+
+    void launchSettings_data()
+    {
+        QTest::addColumn<QList<QByteArray>>("commands");
+        QTest::addColumn<bool>("valid");
+        QTest::addColumn<Fields>("changed");
+
+        // As sent by KDESu::Client, the fields that differ from the defaults
+        QTest::newRow("priority") << QList<QByteArray>{"PRIO 80\n"} << true << Fields{{"priority", "80"}};
+        QTest::newRow("deadline") << QList<QByteArray>{"SCHD 5 1000000 10000000 20000000\n"} << true
+                                  << Fields{{"scheduler", "5"}, {"deadline", "1000000 10000000 20000000"}};
+        QTest::newRow("other scheduler drops deadline") << QList<QByteArray>{"SCHD 5 1000000 10000000 20000000\n", "SCHD 3\n"} << true
+                                                        << Fields{{"scheduler", "3"}};
+        QTest::newRow("affinity") << QList<QByteArray>{"AFFN " + escape("0,2,3") + '\n'} << true << Fields{{"affinity", "0,2,3"}};
+        QTest::newRow("affinity reset") << QList<QByteArray>{"AFFN " + escape("0,2,3") + '\n', "AFFN " + escape("") + '\n'} << true << Fields();
+        QTest::newRow("numa") << QList<QByteArray>{"NUMA 2 " + escape("0,1") + '\n'} << true << Fields{{"numaPolicy", "2"}, {"numaNodes", "0,1"}};
+        QTest::newRow("numa reset") << QList<QByteArray>{"NUMA 2 " + escape("0,1") + '\n', "NUMA 0 " + escape("") + '\n'} << true << Fields();
+        QTest::newRow("I/O priority") << QList<QByteArray>{"IOPR 2 7\n"} << true << Fields{{"ioClass", "2"}, {"ioLevel", "7"}};
+        // Quoted, for negative numbers
+        QTest::newRow("OOM score") << QList<QByteArray>{"OOMS " + escape("-500") + '\n'} << true << Fields{{"oomScoreAdj", "-500"}};
+        QTest::newRow("OOM score changed") << QList<QByteArray>{"OOMS " + escape("-500") + '\n', "OOMS " + escape("300") + '\n'} << true
+                                           << Fields{{"oomScoreAdj", "300"}};
+        QTest::newRow("cgroup") << QList<QByteArray>{"CGRP " + escape("user.slice/kdesu") + '\n'} << true << Fields{{"cgroup", "user.slice/kdesu"}};
+        QTest::newRow("cgroup limits") << QList<QByteArray>{"CGLM 1 " + escape("512M") + '\n',
+                                                            "CGLM 0 " + escape("50000 100000") + '\n',
+                                                            "CGLM 3 " + escape("64") + '\n'}
+                                       << true << Fields{{"cpu.max", "50000 100000"}, {"memory.max", "512M"}, {"pids.max", "64"}};
+
+        QTest::newRow("priority missing") << QList<QByteArray>{"PRIO\n"} << false << Fields();
+        QTest::newRow("deadline incomplete") << QList<QByteArray>{"SCHD 5 1000000\n"} << false << Fields();
+        QTest::newRow("scheduler name") << QList<QByteArray>{"SCHD " + escape("normal") + '\n'} << false << Fields();
+        QTest::newRow("negative CPU") << QList<QByteArray>{"AFFN " + escape("0,-1") + '\n'} << false << Fields();
+        QTest::newRow("empty CPU") << QList<QByteArray>{"AFFN " + escape("0,,1") + '\n'} << false << Fields();
+        QTest::newRow("CPU name") << QList<QByteArray>{"AFFN " + escape("all") + '\n'} << false << Fields();
+        QTest::newRow("unquoted CPU") << QList<QByteArray>{"AFFN 3\n"} << false << Fields();
+        QTest::newRow("numa nodes missing") << QList<QByteArray>{"NUMA 1\n"} << false << Fields();
+        QTest::newRow("numa node name") << QList<QByteArray>{"NUMA 1 " + escape("node0") + '\n'} << false << Fields();
+        QTest::newRow("numa policy name") << QList<QByteArray>{"NUMA " + escape("bind") + ' ' + escape("0") + '\n'} << false << Fields();
+        QTest::newRow("I/O level missing") << QList<QByteArray>{"IOPR 2\n"} << false << Fields();
+        QTest::newRow("I/O class name") << QList<QByteArray>{"IOPR " + escape("idle") + " 0\n"} << false << Fields();
+        QTest::newRow("unquoted OOM score") << QList<QByteArray>{"OOMS 300\n"} << false << Fields();
+        QTest::newRow("OOM score name") << QList<QByteArray>{"OOMS " + escape("low") + '\n'} << false << Fields();
+        QTest::newRow("cgroup missing") << QList<QByteArray>{"CGRP\n"} << false << Fields();
+        QTest::newRow("no such limit") << QList<QByteArray>{"CGLM 4 " + escape("1") + '\n'} << false << Fields();
+        QTest::newRow("limit name") << QList<QByteArray>{"CGLM " + escape("memory.max") + ' ' + escape("1") + '\n'} << false << Fields();
+        QTest::newRow("unquoted limit") << QList<QByteArray>{"CGLM 1 512\n"} << false << Fields();
+    }
+
+    void launchSettings()
+    {
+        QFETCH(QList<QByteArray>, commands);
+        QFETCH(bool, valid);
+        QFETCH(Fields, changed);
+
+        // In an invalid row, only the last command fails to parse
+        LaunchSettings settings;
+        for (qsizetype i = 0; i < commands.size(); ++i) {
+            QCOMPARE(parseLaunch(&settings, commands[i]), valid || i < commands.size() - 1);
+        }
+        if (!valid) {
+            return;
+        }
+
+        Fields expected = fields(LaunchSettings());
+        for (auto it = changed.cbegin(); it != changed.cend(); ++it) {
+            QVERIFY(expected.contains(it.key()));
+            expected.insert(it.key(), it.value());
+        }
+        QCOMPARE(fields(settings), expected);
+    }
+
+    void needsRoot_data()
+    {
+        QTest::addColumn<QList<QByteArray>>("commands");
+        QTest::addColumn<bool>("root");
+
+        // Like SuProcess::start()
+        QTest::newRow("defaults") << QList<QByteArray>() << false;
+        QTest::newRow("normal") << QList<QByteArray>{"SCHD 0\n"} << false;
+        QTest::newRow("realtime") << QList<QByteArray>{"SCHD 1\n"} << true;
+        QTest::newRow("round robin") << QList<QByteArray>{"SCHD 2\n"} << true;
+        QTest::newRow("batch") << QList<QByteArray>{"SCHD 3\n"} << false;
+        QTest::newRow("idle") << QList<QByteArray>{"SCHD 4\n"} << false;
+        QTest::newRow("deadline") << QList<QByteArray>{"SCHD 5 1000000 10000000 10000000\n"} << true;
+        QTest::newRow("priority 50") << QList<QByteArray>{"PRIO 50\n"} << false;
+        QTest::newRow("priority 51") << QList<QByteArray>{"PRIO 51\n"} << true;
+        QTest::newRow("priority 0") << QList<QByteArray>{"PRIO 0\n"} << false;
+        QTest::newRow("affinity") << QList<QByteArray>{"AFFN " + escape("0") + '\n'} << false;
+        QTest::newRow("numa") << QList<QByteArray>{"NUMA 1 " + escape("0") + '\n'} << false;
+        QTest::newRow("realtime I/O") << QList<QByteArray>{"IOPR 1 4\n"} << true;
+        QTest::newRow("best effort I/O") << QList<QByteArray>{"IOPR 2 0\n"} << false;
+        QTest::newRow("idle I/O") << QList<QByteArray>{"IOPR 3 0\n"} << false;
+        QTest::newRow("lower OOM score") << QList<QByteArray>{"OOMS " + escape("-1") + '\n'} << true;
+        QTest::newRow("OOM score 0") << QList<QByteArray>{"OOMS " + escape("0") + '\n'} << false;
+        QTest::newRow("higher OOM score") << QList<QByteArray>{"OOMS " + escape("500") + '\n'} << false;
+        QTest::newRow("cgroup") << QList<QByteArray>{"CGRP " + escape("kdesu") + '\n', "CGLM 3 " + escape("64") + '\n'} << false;
+        QTest::newRow("back to normal") << QList<QByteArray>{"SCHD 1\n", "SCHD 0\n"} << false;
+    }
+
+    void needsRoot()
+    {
+        QFETCH(QList<QByteArray>, commands);
+        QFETCH(bool, root);
+
+        LaunchSettings settings;
+        for (const QByteArray &command : std::as_const(commands)) {
+            QVERIFY(parseLaunch(&settings, command));
+        }
+        QCOMPARE(settings.needsRoot(), root);
+    }
+
+private:
+    using Fields = QMap<QByteArray, QByteArray>;
+
+    // The fields of @p settings, as text
+    static Fields fields(const LaunchSettings &settings)
+    {
+        const auto join = [](const QList<int> &numbers) {
+            QList<QByteArray> items;
+            for (const int number : numbers) {
+                items.append(QByteArray::number(number));
+            }
+            return items.join(',');
+        };
+        return {
+            {"priority", QByteArray::number(settings.priority)},
+            {"scheduler", QByteArray::number(settings.scheduler)},
+            {"deadline", QList<QByteArray>{QByteArray::number(settings.deadline[0]),
+                                           QByteArray::number(settings.deadline[1]),
+                                           QByteArray::number(settings.deadline[2])}
+                             .join(' ')},
+            {"affinity", join(settings.affinity)},
+            {"numaPolicy", QByteArray::number(settings.numaPolicy)},
+            {"numaNodes", join(settings.numaNodes)},
+            {"ioClass", QByteArray::number(settings.ioClass)},
+            {"ioLevel", QByteArray::number(settings.ioLevel)},
+            {"oomScoreAdj", settings.hasOomScoreAdj ? QByteArray::number(settings.oomScoreAdj) : QByteArray("unset")},
+            {"cgroup", settings.cgroup},
+            {"cpu.max", settings.cgroupLimits[SuProcess::CgroupCpuMax]},
+            {"memory.max", settings.cgroupLimits[SuProcess::CgroupMemoryMax]},
+            {"io.max", settings.cgroupLimits[SuProcess::CgroupIoMax]},
+            {"pids.max", settings.cgroupLimits[SuProcess::CgroupPidsMax]},
+        };
+    }
+
+    // Process a launch setting like ConnectionHandler::doCommand
+    static bool parseLaunch(LaunchSettings *settings, const QByteArray &cmd)
+    {
+        Lexer l(cmd);
+        return settings->parse(l.lex(), l);
+    }
+
+    // Splits a STAT reply into its name=value pairs
+    static QMap<QByteArray, QByteArray> parseReport(const QByteArray &report)
+    {
+        QMap<QByteArray, QByteArray> values;
+        const QList<QByteArray> items = report.split(' ');
+        for (const QByteArray &item : items) {
+            const int pos = item.indexOf('=');
+            values.insert(item.left(pos), item.mid(pos + 1));
+        }
+        return values;
+    }
 };
 }
 
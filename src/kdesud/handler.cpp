@@ -16,13 +16,17 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <utility>
+
 #include <sys/socket.h>
 
+#include <kdesutrace_p.h>
 #include <sshprocess.h>
 #include <suprocess.h>
 
 #include "lexer.h"
 #include "repo.h"
+#include "stats.h"
 
 using namespace KDESu;
 
@@ -30,6 +34,7 @@ using namespace KDESu;
 
 // Global repository
 extern Repository *repo;
+extern Statistics *statistics;
 void kdesud_cleanup();
 
 ConnectionHandler::ConnectionHandler(int fd)
@@ -40,8 +45,6 @@ ConnectionHandler::ConnectionHandler(int fd)
     , m_pid(0)
 {
     m_Fd = fd;
-    m_Priority = 50;
-    m_Scheduler = SuProcess::SchedNormal;
 }
 
 ConnectionHandler::~ConnectionHandler()
@@ -101,6 +104,26 @@ int ConnectionHandler::handle()
     return 0;
 }
 
+/*
+ * Encode an argument list for the password cache. Every argument is
+ * prefixed with its length, so no two lists give the same key.
+ */
+QByteArray ConnectionHandler::argumentsKey(const QList<QByteArray> &args)
+{
+    QByteArray res;
+    for (const QByteArray &arg : args) {
+        res += QByteArray::number(arg.size());
+        res += ':';
+        res += arg;
+    }
+    return res;
+}
+
+/*
+ * Keys are namespaced: 0 holds the passwords of commands and 2 their
+ * environment, 1 the variables, and 3 and 4 the same as 0 and 2 for
+ * argument lists, which must not share the entries of command strings.
+ */
 QByteArray ConnectionHandler::makeKey(int _namespace, const QByteArray &s1, const QByteArray &s2, const QByteArray &s3) const
 {
     QByteArray res;
@@ -145,6 +168,7 @@ void ConnectionHandler::respond(int ok, const QByteArray &s)
     buf += '\n';
 
     send(m_Fd, buf.data(), buf.length(), 0);
+    KDESU_TRACE2(daemon_reply, m_Fd, ok == Res_OK);
 }
 
 /*
@@ -171,6 +195,8 @@ int ConnectionHandler::doCommand(QByteArray buf)
 
     Lexer *l = new Lexer(buf);
     int tok = l->lex();
+    KDESU_TRACE2(daemon_command, m_Fd, tok);
+    statistics->commandReceived(tok);
     switch (tok) {
     case Lexer::Tok_pass: // "PASS password:string timeout:int\n"
         tok = l->lex();
@@ -207,29 +233,34 @@ int ConnectionHandler::doCommand(QByteArray buf)
         respond(Res_OK);
         break;
 
-    case Lexer::Tok_prio: // "PRIO priority:int\n"
-        tok = l->lex();
-        if (tok != Lexer::Tok_num) {
+    // The launch settings of the next EXEC, see launch.cpp
+    case Lexer::Tok_prio:
+    case Lexer::Tok_sched:
+    case Lexer::Tok_affinity:
+    case Lexer::Tok_numa:
+    case Lexer::Tok_ioprio:
+    case Lexer::Tok_oom:
+    case Lexer::Tok_cgroup:
+    case Lexer::Tok_cgroupLimit:
+        if (!m_Launch.parse(tok, *l)) {
             goto parse_error;
         }
-        m_Priority = l->lval().toInt();
-        if (l->lex() != '\n') {
-            goto parse_error;
-        }
-        qCDebug(KSUD_LOG) << "priority set to " << m_Priority;
         respond(Res_OK);
         break;
 
-    case Lexer::Tok_sched: // "SCHD scheduler:int\n"
-        tok = l->lex();
-        if (tok != Lexer::Tok_num) {
-            goto parse_error;
+    case Lexer::Tok_args: // "ARGS (arg:string)+\n"
+        m_Args.clear();
+        while ((tok = l->lex()) != '\n') {
+            if (tok != Lexer::Tok_str) {
+                m_Args.clear();
+                goto parse_error;
+            }
+            m_Args.append(l->lval());
         }
-        m_Scheduler = l->lval().toInt();
-        if (l->lex() != '\n') {
+        if (m_Args.isEmpty()) {
             goto parse_error;
         }
-        qCDebug(KSUD_LOG) << "Scheduler set to " << m_Scheduler;
+        qCDebug(KSUD_LOG) << "Arguments set to " << m_Args;
         respond(Res_OK);
         break;
 
@@ -237,6 +268,8 @@ int ConnectionHandler::doCommand(QByteArray buf)
     {
         QByteArray options;
         QList<QByteArray> env;
+        // Run without a shell if ARGS came first, command is only logged then
+        const QList<QByteArray> args = std::exchange(m_Args, QList<QByteArray>());
         tok = l->lex();
         if (tok != Lexer::Tok_str) {
             goto parse_error;
@@ -268,17 +301,21 @@ int ConnectionHandler::doCommand(QByteArray buf)
         }
 
         QByteArray auth_user;
-        if ((m_Scheduler != SuProcess::SchedNormal) || (m_Priority > 50)) {
+        if (m_Launch.needsRoot()) {
             auth_user = "root";
         } else {
             auth_user = user;
         }
-        key = makeKey(2, m_Host, auth_user, command);
+        const int passSpace = args.isEmpty() ? 0 : 3;
+        const int envSpace = args.isEmpty() ? 2 : 4;
+        const QByteArray keyCommand = args.isEmpty() ? command : argumentsKey(args);
+        key = makeKey(envSpace, m_Host, auth_user, keyCommand);
         // We only use the command if the environment is the same.
         if (repo->find(key) == env_check) {
-            key = makeKey(0, m_Host, auth_user, command);
+            key = makeKey(passSpace, m_Host, auth_user, keyCommand);
             pass = repo->find(key);
         }
+        statistics->cacheLookup(!pass.isNull());
         if (pass.isNull()) // isNull() means no password, isEmpty() can mean empty password
         {
             if (m_Pass.isNull()) {
@@ -287,11 +324,11 @@ int ConnectionHandler::doCommand(QByteArray buf)
             }
             data.value = env_check;
             data.timeout = m_Timeout;
-            key = makeKey(2, m_Host, auth_user, command);
+            key = makeKey(envSpace, m_Host, auth_user, keyCommand);
             repo->add(key, data);
             data.value = m_Pass;
             data.timeout = m_Timeout;
-            key = makeKey(0, m_Host, auth_user, command);
+            key = makeKey(passSpace, m_Host, auth_user, keyCommand);
             repo->add(key, data);
             pass = m_Pass;
         }
@@ -305,6 +342,7 @@ int ConnectionHandler::doCommand(QByteArray buf)
             break;
         } else if (pid > 0) {
             m_pid = pid;
+            statistics->execStarted(pid);
             respond(Res_OK);
             break;
         }
@@ -315,18 +353,25 @@ int ConnectionHandler::doCommand(QByteArray buf)
         int ret;
         if (m_Host.isEmpty()) {
             SuProcess proc;
-            proc.setCommand(command);
+            if (args.isEmpty()) {
+                proc.setCommand(command);
+            } else {
+                proc.setArguments(args);
+            }
             proc.setUser(user);
             if (options.contains('x')) {
                 proc.setXOnly(true);
             }
-            proc.setPriority(m_Priority);
-            proc.setScheduler(m_Scheduler);
+            m_Launch.apply(proc);
             proc.setEnvironment(env);
             ret = proc.exec(pass.data());
         } else {
             SshProcess proc;
-            proc.setCommand(command);
+            if (args.isEmpty()) {
+                proc.setCommand(command);
+            } else {
+                proc.setArguments(args);
+            }
             proc.setUser(user);
             proc.setHost(m_Host);
             ret = proc.exec(pass.data());
@@ -337,6 +382,9 @@ int ConnectionHandler::doCommand(QByteArray buf)
     }
 
     case Lexer::Tok_delCmd: // "DEL command:string user:string\n"
+    {
+        // Remove the password of an argument list if ARGS came first
+        const QList<QByteArray> args = std::exchange(m_Args, QList<QByteArray>());
         tok = l->lex();
         if (tok != Lexer::Tok_str) {
             goto parse_error;
@@ -350,7 +398,11 @@ int ConnectionHandler::doCommand(QByteArray buf)
         if (l->lex() != '\n') {
             goto parse_error;
         }
-        key = makeKey(0, m_Host, user, command);
+        if (!args.isEmpty()) {
+            key = makeKey(3, m_Host, user, argumentsKey(args));
+        } else {
+            key = makeKey(0, m_Host, user, command);
+        }
         if (repo->remove(key) < 0) {
             qCDebug(KSUD_LOG) << "Unknown command: " << command;
             respond(Res_NO);
@@ -359,6 +411,7 @@ int ConnectionHandler::doCommand(QByteArray buf)
             respond(Res_OK);
         }
         break;
+    }
 
     case Lexer::Tok_delVar: // "DELV name:string \n"
     {
@@ -502,6 +555,14 @@ int ConnectionHandler::doCommand(QByteArray buf)
         respond(Res_OK);
         break;
 
+    case Lexer::Tok_stat: // "STAT\n"
+        tok = l->lex();
+        if (tok != '\n') {
+            goto parse_error;
+        }
+        respond(Res_OK, statistics->report(*repo));
+        break;
+
     case Lexer::Tok_exit: // "EXIT\n"
         tok = l->lex();
         if (tok != '\n') {
@@ -9,8 +9,10 @@
 
 #include <sys/types.h>
 
+#include "launch.h"
 #include "secure.h"
 #include <QByteArray>
+#include <QList>
 
 /*!
  * A ConnectionHandler handles a client. It is called from the main program
@@ -42,11 +44,14 @@ private:
 
     int doCommand(QByteArray buf);
     void respond(int ok, const QByteArray &s = QByteArray());
+    static QByteArray argumentsKey(const QList<QByteArray> &args);
     QByteArray makeKey(int namspace, const QByteArray &s1, const QByteArray &s2 = QByteArray(), const QByteArray &s3 = QByteArray()) const;
 
     int m_Fd, m_Timeout;
-    int m_Priority, m_Scheduler;
+    LaunchSettings m_Launch;
     QByteArray m_Buf, m_Pass, m_Host;
+    // Set by ARGS, used by the next EXEC
+    QList<QByteArray> m_Args;
 
 public:
     int m_exitCode;
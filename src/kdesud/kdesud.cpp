@@ -30,6 +30,10 @@
                                NO         <command>.
 
     PING                       OK         Ping the server (diagnostics).
+
+    STAT                       OK <stats> Report usage counters as space
+                                          separated name=value pairs
+                                          (diagnostics).
 */
 
 #include "config-kdesud.h"
@@ -78,6 +82,9 @@
 
 #include "handler.h"
 #include "repo.h"
+#include "stats.h"
+
+#include <kdesutrace_p.h>
 
 #if HAVE_X11
 #include <X11/X.h>
@@ -151,6 +158,7 @@ static int closeExtraFds()
 // Globals
 
 Repository *repo;
+Statistics *statistics;
 QString Version(QStringLiteral("1.01"));
 QByteArray sock;
 #if HAVE_X11
@@ -413,6 +421,7 @@ int main(int argc, char *argv[])
 #endif
 
     repo = new Repository;
+    statistics = new Statistics;
     QList<ConnectionHandler *> handler;
 
     pipe2(pipeOfDeath, O_CLOEXEC);
@@ -465,7 +474,7 @@ int main(int argc, char *argv[])
             qCCritical(KSUD_LOG) << "select(): " << ERR << "\n";
             exit(1);
         }
-        repo->expire();
+        statistics->entriesExpired(repo->expire());
         for (int i = 0; i <= maxfd; i++) {
             if (!FD_ISSET(i, &tmp_fds)) {
                 continue;
@@ -479,6 +488,7 @@ int main(int argc, char *argv[])
                     int status;
                     result = waitpid((pid_t)-1, &status, WNOHANG);
                     if (result > 0) {
+                        statistics->execFinished(result);
                         for (int j = handler.size(); j--;) {
                             if (handler[j] && (handler[j]->m_pid == result)) {
                                 handler[j]->m_exitCode = WEXITSTATUS(status);
@@ -514,11 +524,16 @@ int main(int argc, char *argv[])
                     qCCritical(KSUD_LOG) << "accept():" << ERR << "\n";
                     continue;
                 }
+                KDESU_TRACE1(daemon_accept, fd);
                 while (fd + 1 > (int)handler.size()) {
                     handler.append(nullptr);
                 }
-                delete handler[fd];
+                if (handler[fd]) {
+                    delete handler[fd];
+                    statistics->connectionClosed();
+                }
                 handler[fd] = new ConnectionHandler(fd);
+                statistics->connectionOpened();
                 maxfd = qMax(maxfd, fd);
                 FD_SET(fd, &active_fds);
                 fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
@@ -529,6 +544,7 @@ int main(int argc, char *argv[])
             if (handler[i] && handler[i]->handle() < 0) {
                 delete handler[i];
                 handler[i] = nullptr;
+                statistics->connectionClosed();
                 FD_CLR(i, &active_fds);
             }
         }
@@ -0,0 +1,219 @@
+/* vi: ts=8 sts=4 sw=4
+
+    This file is part of the KDE project, module kdesu.
+    SPDX-FileCopyrightText: 2026 KDE Contributors
+
+    SPDX-License-Identifier: GPL-2.0-only
+
+    launch.cpp: Per connection launch settings for kdesud.
+*/
+
+#include "launch.h"
+
+#include <ksud_debug.h>
+
+#include <suprocess.h>
+
+#include "lexer.h"
+
+using namespace KDESu;
+
+LaunchSettings::LaunchSettings()
+{
+    priority = 50;
+    scheduler = SuProcess::SchedNormal;
+    deadline[0] = deadline[1] = deadline[2] = 0;
+    numaPolicy = SuProcess::NumaDefault;
+    ioClass = SuProcess::IoDefault;
+    ioLevel = 4;
+    hasOomScoreAdj = false;
+    oomScoreAdj = 0;
+}
+
+/*
+ * Parse a comma separated list of numbers, as sent by AFFN and NUMA.
+ */
+static bool parseNumbers(const QByteArray &str, QList<int> *numbers)
+{
+    numbers->clear();
+    if (str.isEmpty()) {
+        return true;
+    }
+    const QList<QByteArray> items = str.split(',');
+    for (const QByteArray &item : items) {
+        bool ok;
+        const int number = item.toInt(&ok);
+        if (!ok || number < 0) {
+            numbers->clear();
+            return false;
+        }
+        numbers->append(number);
+    }
+    return true;
+}
+
+bool LaunchSettings::parse(int token, Lexer &l)
+{
+    int tok;
+
+    switch (token) {
+    case Lexer::Tok_prio: // "PRIO priority:int\n"
+        tok = l.lex();
+        if (tok != Lexer::Tok_num) {
+            return false;
+        }
+        priority = l.lval().toInt();
+        if (l.lex() != '\n') {
+            return false;
+        }
+        qCDebug(KSUD_LOG) << "priority set to " << priority;
+        return true;
+
+    case Lexer::Tok_sched: // "SCHD scheduler:int [runtime:int deadline:int period:int]\n"
+        tok = l.lex();
+        if (tok != Lexer::Tok_num) {
+            return false;
+        }
+        scheduler = l.lval().toInt();
+        deadline[0] = deadline[1] = deadline[2] = 0;
+        tok = l.lex();
+        if (tok != '\n') {
+            for (int i = 0; i < 3; ++i) {
+                if (tok != Lexer::Tok_num) {
+                    return false;
+                }
+                deadline[i] = l.lval().toLongLong();
+                tok = l.lex();
+            }
+            if (tok != '\n') {
+                return false;
+            }
+        }
+        qCDebug(KSUD_LOG) << "Scheduler set to " << scheduler;
+        return true;
+
+    case Lexer::Tok_affinity: // "AFFN cpus:string\n"
+        tok = l.lex();
+        if (tok != Lexer::Tok_str || !parseNumbers(l.lval(), &affinity)) {
+            return false;
+        }
+        if (l.lex() != '\n') {
+            return false;
+        }
+        qCDebug(KSUD_LOG) << "CPU affinity set to " << affinity;
+        return true;
+
+    case Lexer::Tok_numa: // "NUMA policy:int nodes:string\n"
+        tok = l.lex();
+        if (tok != Lexer::Tok_num) {
+            return false;
+        }
+        numaPolicy = l.lval().toInt();
+        tok = l.lex();
+        if (tok != Lexer::Tok_str || !parseNumbers(l.lval(), &numaNodes)) {
+            return false;
+        }
+        if (l.lex() != '\n') {
+            return false;
+        }
+        qCDebug(KSUD_LOG) << "NUMA policy set to " << numaPolicy << numaNodes;
+        return true;
+
+    case Lexer::Tok_ioprio: // "IOPR class:int level:int\n"
+        tok = l.lex();
+        if (tok != Lexer::Tok_num) {
+            return false;
+        }
+        ioClass = l.lval().toInt();
+        tok = l.lex();
+        if (tok != Lexer::Tok_num) {
+            return false;
+        }
+        ioLevel = l.lval().toInt();
+        if (l.lex() != '\n') {
+            return false;
+        }
+        qCDebug(KSUD_LOG) << "I/O priority set to " << ioClass << ioLevel;
+        return true;
+
+    case Lexer::Tok_oom: { // "OOMS adjust:string\n"
+        tok = l.lex();
+        if (tok != Lexer::Tok_str) {
+            return false;
+        }
+        bool ok;
+        const int adjust = l.lval().toInt(&ok);
+        if (!ok || l.lex() != '\n') {
+            return false;
+        }
+        hasOomScoreAdj = true;
+        oomScoreAdj = adjust;
+        qCDebug(KSUD_LOG) << "OOM score adjustment set to " << oomScoreAdj;
+        return true;
+    }
+
+    case Lexer::Tok_cgroup: // "CGRP parent:string\n"
+        tok = l.lex();
+        if (tok != Lexer::Tok_str) {
+            return false;
+        }
+        cgroup = l.lval();
+        if (l.lex() != '\n') {
+            return false;
+        }
+        qCDebug(KSUD_LOG) << "Cgroup set to " << cgroup;
+        return true;
+
+    case Lexer::Tok_cgroupLimit: { // "CGLM limit:int value:string\n"
+        tok = l.lex();
+        if (tok != Lexer::Tok_num) {
+            return false;
+        }
+        const int limit = l.lval().toInt();
+        if (limit < SuProcess::CgroupCpuMax || limit > SuProcess::CgroupPidsMax) {
+            return false;
+        }
+        tok = l.lex();
+        if (tok != Lexer::Tok_str) {
+            return false;
+        }
+        cgroupLimits[limit] = l.lval();
+        if (l.lex() != '\n') {
+            return false;
+        }
+        qCDebug(KSUD_LOG) << "Cgroup limit " << limit << " set to " << cgroupLimits[limit];
+        return true;
+    }
+
+    default:
+        return false;
+    }
+}
+
+/*
+ * The same as SuProcess::start(), which would switch to root anyway: real
+ * time and deadline scheduling, a raised priority, real time I/O and a
+ * lowered OOM score need it. The password is cached for that user.
+ */
+bool LaunchSettings::needsRoot() const
+{
+    return (scheduler == SuProcess::SchedRealtime) || (scheduler == SuProcess::SchedRoundRobin) || (scheduler == SuProcess::SchedDeadline)
+        || (priority > 50) || (ioClass == SuProcess::IoRealtime) || (hasOomScoreAdj && oomScoreAdj < 0);
+}
+
+void LaunchSettings::apply(SuProcess &proc) const
+{
+    proc.setPriority(priority);
+    proc.setScheduler(scheduler);
+    proc.setDeadline(deadline[0], deadline[1], deadline[2]);
+    proc.setCpuAffinity(affinity);
+    proc.setNumaPolicy(static_cast<SuProcess::NumaPolicy>(numaPolicy), numaNodes);
+    proc.setIoPriority(static_cast<SuProcess::IoPriorityClass>(ioClass), ioLevel);
+    if (hasOomScoreAdj) {
+        proc.setOomScoreAdjust(oomScoreAdj);
+    }
+    proc.setCgroup(cgroup);
+    for (int limit = SuProcess::CgroupCpuMax; limit <= SuProcess::CgroupPidsMax; ++limit) {
+        proc.setCgroupLimit(static_cast<SuProcess::CgroupLimit>(limit), cgroupLimits[limit]);
+    }
+}
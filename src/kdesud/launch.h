@@ -0,0 +1,57 @@
+/* vi: ts=8 sts=4 sw=4
+
+    This file is part of the KDE project, module kdesu.
+    SPDX-FileCopyrightText: 2026 KDE Contributors
+
+    SPDX-License-Identifier: GPL-2.0-only
+*/
+
+#ifndef __Launch_h_included__
+#define __Launch_h_included__
+
+#include <QByteArray>
+#include <QList>
+
+class Lexer;
+
+namespace KDESu
+{
+class SuProcess;
+}
+
+/*!
+ * How EXEC launches the commands of a connection: the scheduling, placement
+ * and resource settings of PRIO, SCHD, AFFN, NUMA, IOPR, OOMS, CGRP and CGLM.
+ */
+struct LaunchSettings {
+    LaunchSettings();
+
+    /*!
+     * Parse the arguments of the command @p token from @p l, up to and
+     * including the newline. Returns false on a parse error.
+     */
+    bool parse(int token, Lexer &l);
+
+    /*! Whether the command has to run as root, whatever the user. */
+    bool needsRoot() const;
+
+    /*! Pass the settings on to @p proc. */
+    void apply(KDESu::SuProcess &proc) const;
+
+    int priority;
+    int scheduler;
+    // Runtime, deadline and period of SchedDeadline
+    qint64 deadline[3];
+    QList<int> affinity;
+    int numaPolicy;
+    QList<int> numaNodes;
+    int ioClass;
+    int ioLevel;
+    bool hasOomScoreAdj;
+    int oomScoreAdj;
+    QByteArray cgroup;
+    // Indexed by SuProcess::CgroupLimit
+    QByteArray cgroupLimits[4];
+};
+
+#endif
@@ -156,6 +156,30 @@ int Lexer::lex()
             if (m_Output == "CHKG") {
                 return Tok_chkGroup;
             }
+            if (m_Output == "STAT") {
+                return Tok_stat;
+            }
+            if (m_Output == "ARGS") {
+                return Tok_args;
+            }
+            if (m_Output == "AFFN") {
+                return Tok_affinity;
+            }
+            if (m_Output == "NUMA") {
+                return Tok_numa;
+            }
+            if (m_Output == "IOPR") {
+                return Tok_ioprio;
+            }
+            if (m_Output == "OOMS") {
+                return Tok_oom;
+            }
+            if (m_Output == "CGRP") {
+                return Tok_cgroup;
+            }
+            if (m_Output == "CGLM") {
+                return Tok_cgroupLimit;
+            }
         }
 
         return Tok_str;
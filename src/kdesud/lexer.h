@@ -48,6 +48,14 @@ public:
         Tok_chkGroup,
         Tok_delSpecialKey,
         Tok_exit,
+        Tok_stat,
+        Tok_args,
+        Tok_affinity,
+        Tok_numa,
+        Tok_ioprio,
+        Tok_oom,
+        Tok_cgroup,
+        Tok_cgroupLimit,
     };
 
 private:
@@ -148,6 +148,20 @@ QByteArray Repository::find(const QByteArray &key) const
     return it.value().value;
 }
 
+int Repository::count() const
+{
+    return repo.count();
+}
+
+qint64 Repository::bytes() const
+{
+    qint64 n = 0;
+    for (RepoCIterator it = repo.constBegin(); it != repo.constEnd(); ++it) {
+        n += it.key().size() + it.value().value.size() + it.value().group.size();
+    }
+    return n;
+}
+
 int Repository::expire()
 {
     unsigned current = time(nullptr);
@@ -54,6 +54,12 @@ public:
     /*! Returns the key values for the given group. */
     QByteArray findKeys(const QByteArray &group, const char *sep = "-") const;
 
+    /*! Returns the number of data elements. */
+    int count() const;
+
+    /*! Returns the number of bytes held by keys, values and groups. */
+    qint64 bytes() const;
+
 private:
     QMap<QByteArray, Data_entry> repo;
     typedef QMap<QByteArray, Data_entry>::Iterator RepoIterator;
@@ -0,0 +1,175 @@
+/* vi: ts=8 sts=4 sw=4
+
+    This file is part of the KDE project, module kdesu.
+    SPDX-FileCopyrightText: 2026 KDE Contributors
+
+    SPDX-License-Identifier: GPL-2.0-only
+
+    stats.cpp: Usage counters for kdesud.
+*/
+
+#include "stats.h"
+
+#include "lexer.h"
+#include "repo.h"
+
+// Upper bounds (in ms) of the fork-to-exit latency histogram buckets.
+// The last bucket catches everything above the last bound.
+static const struct {
+    qint64 bound;
+    const char *name;
+} latencyBuckets[] = {
+    {100, "100ms"},
+    {1000, "1s"},
+    {10000, "10s"},
+    {60000, "1m"},
+    {600000, "10m"},
+    {-1, "inf"},
+};
+
+static QByteArray commandName(int token)
+{
+    switch (token) {
+    case Lexer::Tok_exec:
+        return "EXEC";
+    case Lexer::Tok_pass:
+        return "PASS";
+    case Lexer::Tok_delCmd:
+        return "DEL";
+    case Lexer::Tok_ping:
+        return "PING";
+    case Lexer::Tok_stop:
+        return "STOP";
+    case Lexer::Tok_set:
+        return "SET";
+    case Lexer::Tok_get:
+        return "GET";
+    case Lexer::Tok_delVar:
+        return "DELV";
+    case Lexer::Tok_delGroup:
+        return "DELG";
+    case Lexer::Tok_host:
+        return "HOST";
+    case Lexer::Tok_prio:
+        return "PRIO";
+    case Lexer::Tok_sched:
+        return "SCHD";
+    case Lexer::Tok_getKeys:
+        return "GETK";
+    case Lexer::Tok_chkGroup:
+        return "CHKG";
+    case Lexer::Tok_delSpecialKey:
+        return "DELS";
+    case Lexer::Tok_exit:
+        return "EXIT";
+    case Lexer::Tok_stat:
+        return "STAT";
+    case Lexer::Tok_args:
+        return "ARGS";
+    case Lexer::Tok_affinity:
+        return "AFFN";
+    case Lexer::Tok_numa:
+        return "NUMA";
+    case Lexer::Tok_ioprio:
+        return "IOPR";
+    case Lexer::Tok_oom:
+        return "OOMS";
+    case Lexer::Tok_cgroup:
+        return "CGRP";
+    case Lexer::Tok_cgroupLimit:
+        return "CGLM";
+    default:
+        return "other";
+    }
+}
+
+Statistics::Statistics()
+{
+    static_assert(sizeof(latencyBuckets) / sizeof(latencyBuckets[0]) == LatencyBuckets);
+    m_clock.start();
+}
+
+void Statistics::connectionOpened()
+{
+    m_connections++;
+    m_activeConnections++;
+}
+
+void Statistics::connectionClosed()
+{
+    if (m_activeConnections > 0) {
+        m_activeConnections--;
+    }
+}
+
+void Statistics::commandReceived(int token)
+{
+    m_commands[commandName(token)]++;
+}
+
+void Statistics::cacheLookup(bool hit)
+{
+    if (hit) {
+        m_cacheHits++;
+    } else {
+        m_cacheMisses++;
+    }
+}
+
+void Statistics::entriesExpired(int count)
+{
+    m_expired += count;
+}
+
+void Statistics::execStarted(pid_t pid)
+{
+    m_running.insert(pid, m_clock.elapsed());
+}
+
+void Statistics::execFinished(pid_t pid)
+{
+    auto it = m_running.find(pid);
+    if (it == m_running.end()) {
+        return;
+    }
+    const qint64 latency = m_clock.elapsed() - it.value();
+    m_running.erase(it);
+    m_execFinished++;
+
+    int i = 0;
+    while (latencyBuckets[i].bound >= 0 && latency > latencyBuckets[i].bound) {
+        i++;
+    }
+    m_latency[i]++;
+}
+
+QByteArray Statistics::report(const Repository &repo) const
+{
+    QByteArray res;
+    auto add = [&res](const QByteArray &name, quint64 value) {
+        if (!res.isEmpty()) {
+            res += ' ';
+        }
+        res += name;
+        res += '=';
+        res += QByteArray::number(value);
+    };
+
+    add("uptime", m_clock.elapsed() / 1000);
+    add("connections", m_connections);
+    add("connections.active", m_activeConnections);
+    for (auto it = m_commands.cbegin(); it != m_commands.cend(); ++it) {
+        add("cmd." + it.key(), it.value());
+    }
+    add("repo.entries", repo.count());
+    add("repo.bytes", repo.bytes());
+    add("repo.expired", m_expired);
+    add("cache.hits", m_cacheHits);
+    add("cache.misses", m_cacheMisses);
+    add("exec.running", m_running.size());
+    add("exec.finished", m_execFinished);
+    for (int i = 0; i < LatencyBuckets; i++) {
+        add(QByteArray("exec.latency.") + latencyBuckets[i].name, m_latency[i]);
+    }
+    return res;
+}
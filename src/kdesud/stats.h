@@ -0,0 +1,80 @@
+/* vi: ts=8 sts=4 sw=4
+
+    This file is part of the KDE project, module kdesu.
+    SPDX-FileCopyrightText: 2026 KDE Contributors
+
+    SPDX-License-Identifier: GPL-2.0-only
+*/
+
+#ifndef __Stats_h_included__
+#define __Stats_h_included__
+
+#include <sys/types.h>
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QMap>
+
+class Repository;
+
+/*!
+ * Usage counters of the daemon, reported by the STAT command.
+ *
+ * All counters are cumulative since the daemon was started, except for
+ * the number of active connections and running EXEC children.
+ */
+
+class Statistics
+{
+public:
+    Statistics();
+
+    Statistics(const Statistics &) = delete;
+    Statistics &operator=(const Statistics &) = delete;
+
+    /*! A client connected. */
+    void connectionOpened();
+
+    /*! A client connection was closed. */
+    void connectionClosed();
+
+    /*! A command with lexer token @p token was received. */
+    void commandReceived(int token);
+
+    /*! An EXEC looked up a cached password, @p hit tells if one was found. */
+    void cacheLookup(bool hit);
+
+    /*! @p count repository entries expired. */
+    void entriesExpired(int count);
+
+    /*! An EXEC child with pid @p pid was forked. */
+    void execStarted(pid_t pid);
+
+    /*! The child @p pid was reaped. */
+    void execFinished(pid_t pid);
+
+    /*!
+     * Returns the statistics as a single line of space separated
+     * "name=value" pairs, suitable for a reply to the client.
+     */
+    QByteArray report(const Repository &repo) const;
+
+private:
+    enum {
+        LatencyBuckets = 6,
+    };
+
+    QElapsedTimer m_clock;
+    quint64 m_connections = 0;
+    quint64 m_activeConnections = 0;
+    QMap<QByteArray, quint64> m_commands;
+    quint64 m_expired = 0;
+    quint64 m_cacheHits = 0;
+    quint64 m_cacheMisses = 0;
+    quint64 m_execFinished = 0;
+    quint64 m_latency[LatencyBuckets] = {};
+    QHash<pid_t, qint64> m_running; // pid -> fork time in ms
+};
+
+#endif
@@ -0,0 +1,54 @@
+/*
+    This file is part of the KDE project, module kdesu.
+    SPDX-FileCopyrightText: 2026 KDE Contributors
+
+    SPDX-License-Identifier: GPL-2.0-only
+
+    kdesutrace_p.h: Static tracepoints (USDT) for libkdesu, kdesu_stub and kdesud.
+*/
+
+#ifndef KDESUTRACE_P_H
+#define KDESUTRACE_P_H
+
+#include <config-kdesu.h>
+
+/*
+ * The probes are SystemTap/DTrace compatible static tracepoints of the
+ * provider "kdesu". They compile to a single nop when nobody is attached,
+ * and can be listed with e.g. "perf list sdt_kdesu:*" (after
+ * "perf buildid-cache --add <binary>") or "bpftrace -l 'usdt:<binary>:*'".
+ *
+ * libKF6Su:
+ *   pty_open(int masterfd)           PTY pair allocated
+ *   fork(int pid)                    child forked, in the parent
+ *   exec(const char *path)           about to exec, in the child
+ *   prompt(const char *line)         password prompt detected
+ *   password_written(int pid)        password sent to su/sudo/ssh
+ *   wait_slave(int pid)              slave turned off ECHO
+ *   stub_request(const char *name)   kdesu_stub asked for a parameter
+ *   stub_done(int result)            conversation with kdesu_stub finished
+ *   child_exit(int pid, int status)  child reaped by waitForChild()
+ *
+ * kdesu_stub:
+ *   stub_param(const char *name, const char *value)  parameter received
+ *   stub_exec(const char *command)   about to exec the command
+ *
+ * kdesud:
+ *   daemon_accept(int fd)            client connected
+ *   daemon_command(int fd, int tok)  command received
+ *   daemon_reply(int fd, int ok)     reply sent
+ */
+
+#if HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define KDESU_TRACE0(probe) DTRACE_PROBE(kdesu, probe)
+#define KDESU_TRACE1(probe, a1) DTRACE_PROBE1(kdesu, probe, a1)
+#define KDESU_TRACE2(probe, a1, a2) DTRACE_PROBE2(kdesu, probe, a1, a2)
+#else
+#define KDESU_TRACE0(probe) ((void)0)
+#define KDESU_TRACE1(probe, a1) ((void)0)
+#define KDESU_TRACE2(probe, a1, a2) ((void)0)
+#endif
+
+#endif // KDESUTRACE_P_H
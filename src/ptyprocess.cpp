@@ -12,34 +12,53 @@
 
 #include "ptyprocess.h"
 #include "kcookie_p.h"
+#include "kdesutrace_p.h"
 #include "ptyprocess_p.h"
+#include "suconfig_p.h"
 
 #include <config-kdesu.h>
 #include <ksu_debug.h>
+#include <ksu_timing_debug.h>
 
 #include <cerrno>
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <termios.h>
 #include <unistd.h>
 
+#include <sys/ioctl.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 
 #if HAVE_SYS_SELECT_H
 #include <sys/select.h> // Needed on some systems.
 #endif
 
+#if HAVE_PIDFD_OPEN
+#include <sys/pidfd.h>
+#endif
+#if !HAVE_PIDFD_OPEN || !HAVE_CLOSE_RANGE
+#include <sys/syscall.h> // pidfd_open, close_range syscalls
+#endif
+
 #include <QFile>
+#include <QMap>
+#include <QMutex>
+#include <QScopeGuard>
 #include <QStandardPaths>
+#include <QThreadPool>
 
-#include <KConfigGroup>
-#include <KSharedConfig>
+#include <memory>
+#include <vector>
 
 extern int kdesuDebugArea();
+extern char **environ;
 
 namespace KDESu
 {
@@ -72,11 +91,10 @@ int PtyProcess::waitMS(int fd, int ms)
 */
 bool PtyProcess::checkPid(pid_t pid)
 {
-    KSharedConfig::Ptr config = KSharedConfig::openConfig();
-    KConfigGroup cg(config, QStringLiteral("super-user-command"));
-    QString superUserCommand = cg.readEntry("super-user-command", "sudo");
+    // Called while polling, so only look at the cached configuration
+    const QString superUserCommand = SuConfig::cached()->superUserCommand;
     // sudo does not accept signals from user so we except it
-    if (superUserCommand == QLatin1String("sudo")) {
+    if (superUserCommand.isEmpty() || superUserCommand == QLatin1String("sudo")) {
         return true;
     } else {
         return kill(pid, 0) == 0;
@@ -112,6 +130,260 @@ int PtyProcess::checkPidExited(pid_t pid)
     return NotExited;
 }
 
+void PtyProcessPrivate::resetTimings()
+{
+    timings = PtyProcess::Timings();
+}
+
+void PtyProcessPrivate::finishTimings(const QElapsedTimer &total, const char *backend)
+{
+    timings.total = total.nsecsElapsed();
+
+    auto us = [](qint64 ns) {
+        return ns < 0 ? ns : ns / 1000;
+    };
+    qCDebug(KSU_TIMING_LOG).nospace() << "exec timings (us): backend=" << backend << " pty_open=" << us(timings.ptyOpen)
+                                      << " spawn=" << us(timings.spawn) << " prompt=" << us(timings.prompt) << " wait_slave=" << us(timings.waitSlave)
+                                      << " stub=" << us(timings.stub) << " cookie=" << us(timings.cookie) << " child=" << us(timings.child)
+                                      << " total=" << us(timings.total);
+}
+
+/*
+ * Returns a file descriptor referring to @p pid that becomes readable when
+ * the process exits, or -1 if the platform does not support it.
+ */
+static int openPidFd(pid_t pid)
+{
+#if HAVE_PIDFD_OPEN
+    return pidfd_open(pid, 0);
+#elif defined(SYS_pidfd_open)
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    Q_UNUSED(pid);
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+void PtyProcessPrivate::closePidFd()
+{
+    if (pidFd >= 0) {
+        close(pidFd);
+        pidFd = -1;
+    }
+}
+
+void PtyProcessPrivate::closeChannel()
+{
+    if (channelFd >= 0) {
+        close(channelFd);
+        channelFd = -1;
+    }
+}
+
+void PtyProcessPrivate::closeInput()
+{
+    if (channelFd >= 0) {
+        shutdown(channelFd, SHUT_WR);
+    }
+}
+
+/*
+ * Put the master into packet mode and set EXTPROC on the slave. With both,
+ * every termios change of the slave shows up as a TIOCPKT_IOCTL control
+ * packet on the master, which lets waitSlave() sleep in poll() instead of
+ * polling the ECHO flag. Only for the password exchange, the command must
+ * not run with EXTPROC, see disablePacketMode().
+ */
+void PtyProcessPrivate::enablePacketMode()
+{
+    packetMode = false;
+    extProc = false;
+#if defined(TIOCPKT) && defined(TIOCPKT_IOCTL) && defined(EXTPROC)
+    if (!wantPacketMode || !pty) {
+        return;
+    }
+    int on = 1;
+    if (ioctl(pty->masterFd(), TIOCPKT, &on) < 0) {
+        return;
+    }
+
+    struct ::termios tio;
+    if (pty->tcGetAttr(&tio)) {
+        tio.c_lflag |= EXTPROC;
+        if (pty->tcSetAttr(&tio)) {
+            packetMode = true;
+            extProc = true;
+            return;
+        }
+    }
+
+    on = 0;
+    ioctl(pty->masterFd(), TIOCPKT, &on);
+#endif
+}
+
+void PtyProcessPrivate::disablePacketMode()
+{
+#ifdef TIOCPKT
+    if (packetMode) {
+        int off = 0;
+        if (ioctl(pty->masterFd(), TIOCPKT, &off) < 0) {
+            qCCritical(KSU_LOG) << "[" << __FILE__ << ":" << __LINE__ << "] "
+                                << "ioctl(TIOCPKT):" << strerror(errno);
+        }
+        packetMode = false;
+    }
+#endif
+    clearExtProc();
+}
+
+/*
+ * EXTPROC turns off the line editing, echo and signal characters of the
+ * slave. The su or sudo started on the PTY saves the termios with it and
+ * restores them after reading the password, so this is done again when
+ * kdesu_stub runs, before the command gets the terminal.
+ */
+void PtyProcessPrivate::clearExtProc()
+{
+#ifdef EXTPROC
+    struct ::termios tio;
+    if (pty && extProc && pty->tcGetAttr(&tio) && (tio.c_lflag & EXTPROC)) {
+        tio.c_lflag &= ~EXTPROC;
+        if (!pty->tcSetAttr(&tio)) {
+            qCCritical(KSU_LOG) << "[" << __FILE__ << ":" << __LINE__ << "] "
+                                << "tcsetattr():" << strerror(errno);
+        }
+    }
+#endif
+}
+
+void PtyProcessPrivate::consumeInput(qsizetype count)
+{
+    inputPos += count;
+    if (inputPos == inputBuffer.size()) {
+        // resize() keeps the capacity around for the next read
+        inputBuffer.resize(0);
+        inputPos = 0;
+    }
+}
+
+/*
+ * The master stays blocking, it is handed out by fd(). Reads that must not
+ * block ask poll() first, with a @p timeout of 0. Returns 1 if the fd can
+ * be read or written without blocking, 0 on a timeout and -1 on errors.
+ */
+static int waitForFd(int fd, short events, int timeout)
+{
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = events;
+    pfd.revents = 0;
+    int ret;
+    while ((ret = poll(&pfd, 1, timeout)) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    // On POLLHUP, let the following read() report EOF / EIO.
+    return ret > 0 ? 1 : 0;
+}
+
+int PtyProcessPrivate::readInput(bool block)
+{
+    const int fd = masterFd();
+    if (fd < 0) {
+        return -1;
+    }
+
+    // Drop what has been consumed when that is the larger part of the buffer
+    if (inputPos > 0 && inputPos >= pendingInput()) {
+        inputBuffer.remove(0, inputPos);
+        inputPos = 0;
+    }
+
+    int total = 0;
+    while (1) {
+        const int ready = waitForFd(fd, POLLIN, block && total == 0 ? -1 : 0);
+        if (ready < 0) {
+            return total > 0 ? total : -1;
+        }
+        if (ready == 0) {
+            return total;
+        }
+
+        const qsizetype oldSize = inputBuffer.size();
+        inputBuffer.resize(oldSize + 0x8000);
+
+        // In packet mode every read returns one packet starting with a
+        // status byte. Read that into a separate slot so the data lands in
+        // place.
+        char status = TIOCPKT_DATA;
+        struct iovec iov[2];
+        int n = 0;
+        if (packetMode) {
+            iov[n].iov_base = &status;
+            iov[n].iov_len = 1;
+            n++;
+        }
+        iov[n].iov_base = inputBuffer.data() + oldSize;
+        iov[n].iov_len = 0x8000;
+        n++;
+
+        const ssize_t nread = readv(fd, iov, n);
+        const int err = errno;
+        const ssize_t nbytes = packetMode && nread > 0 ? nread - 1 : nread;
+        inputBuffer.resize(oldSize + qMax<ssize_t>(nbytes, 0));
+
+        if (nread < 0) {
+            if (err == EINTR || err == EAGAIN || err == EWOULDBLOCK) {
+                continue;
+            }
+            // EIO: nobody has the slave open anymore
+            return total > 0 ? total : -1;
+        }
+        if (nread == 0) {
+            return total > 0 ? total : -1; // eof
+        }
+        if (status != TIOCPKT_DATA) {
+            // Control packets carry no data
+            termiosChanged = true;
+            continue;
+        }
+        total += nbytes;
+    }
+}
+
+bool PtyProcessPrivate::writeOutput(struct iovec *iov, int count)
+{
+    const int fd = masterFd();
+    while (count > 0) {
+        ssize_t nbytes = writev(fd, iov, count);
+        if (nbytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && waitForFd(fd, POLLOUT, -1) > 0) {
+                continue;
+            }
+            qCCritical(KSU_LOG) << "[" << __FILE__ << ":" << __LINE__ << "] "
+                                << "writev():" << strerror(errno);
+            return false;
+        }
+        // Skip what has been written, the rest goes out with the next call
+        while (count > 0 && size_t(nbytes) >= iov->iov_len) {
+            nbytes -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = static_cast<char *>(iov->iov_base) + nbytes;
+            iov->iov_len -= nbytes;
+        }
+    }
+    return true;
+}
+
 PtyProcess::PtyProcess()
     : PtyProcess(*new PtyProcessPrivate)
 {
@@ -126,21 +398,124 @@ PtyProcess::PtyProcess(PtyProcessPrivate &dd)
 
 PtyProcess::~PtyProcess() = default;
 
+/*
+ * Open a PTY pair. Returns nullptr on failure.
+ */
+static KPty *openPty()
+{
+    KPty *pty = new KPty();
+    if (!pty->open()) {
+        qCCritical(KSU_LOG) << "[" << __FILE__ << ":" << __LINE__ << "] "
+                            << "Failed to open PTY.";
+        delete pty;
+        return nullptr;
+    }
+    return pty;
+}
+
+/*
+ * Process-wide pool of PTY pairs opened ahead of time, see
+ * setPtyPoolSize(). Every pair is handed out once, it is never reused
+ * after a child had it. The pool is shared with the refill tasks, which
+ * may outlive the static.
+ */
+struct PtyPool {
+    ~PtyPool()
+    {
+        qDeleteAll(ready);
+    }
+
+    QMutex mutex;
+    int size = 0;
+    bool refilling = false;
+    QList<KPty *> ready;
+};
+
+static const std::shared_ptr<PtyPool> &ptyPool()
+{
+    static const std::shared_ptr<PtyPool> pool = std::make_shared<PtyPool>();
+    return pool;
+}
+
+// Called with the mutex of the pool held
+static void refillPtyPool(const std::shared_ptr<PtyPool> &pool)
+{
+    if (pool->refilling || pool->ready.size() >= pool->size) {
+        return;
+    }
+    pool->refilling = true;
+    QThreadPool::globalInstance()->start([pool] {
+        while (1) {
+            {
+                QMutexLocker locker(&pool->mutex);
+                if (pool->ready.size() >= pool->size) {
+                    pool->refilling = false;
+                    return;
+                }
+            }
+            KPty *pty = openPty();
+            QMutexLocker locker(&pool->mutex);
+            if (!pty) {
+                pool->refilling = false;
+                return;
+            }
+            pool->ready.append(pty);
+        }
+    });
+}
+
+static KPty *takePooledPty()
+{
+    const std::shared_ptr<PtyPool> &pool = ptyPool();
+    QMutexLocker locker(&pool->mutex);
+    if (pool->size == 0) {
+        return nullptr;
+    }
+    KPty *pty = nullptr;
+    if (!pool->ready.isEmpty()) {
+        pty = pool->ready.takeFirst();
+    }
+    refillPtyPool(pool);
+    return pty;
+}
+
+void PtyProcess::setPtyPoolSize(int size)
+{
+    const std::shared_ptr<PtyPool> &pool = ptyPool();
+    QMutexLocker locker(&pool->mutex);
+    pool->size = qMax(0, size);
+    while (pool->ready.size() > pool->size) {
+        delete pool->ready.takeLast();
+    }
+    refillPtyPool(pool);
+}
+
 int PtyProcess::init()
 {
     Q_D(PtyProcess);
 
+    QElapsedTimer timer;
+    timer.start();
+
     delete d->pty;
-    d->pty = new KPty();
-    if (!d->pty->open()) {
-        qCCritical(KSU_LOG) << "[" << __FILE__ << ":" << __LINE__ << "] "
-                            << "Failed to open PTY.";
-        return -1;
+    d->closePidFd();
+    d->closeChannel();
+    d->pty = takePooledPty();
+    if (!d->pty) {
+        d->pty = openPty();
+        if (!d->pty) {
+            return -1;
+        }
     }
+    d->enablePacketMode();
+    KDESU_TRACE1(pty_open, d->pty->masterFd());
     if (!d->wantLocalEcho) {
         enableLocalEcho(false);
     }
     d->inputBuffer.resize(0);
+    d->inputPos = 0;
+    d->termiosChanged = false;
+    d->timings.ptyOpen = timer.nsecsElapsed();
     return 0;
 }
 
@@ -156,7 +531,7 @@ int PtyProcess::fd() const
 {
     Q_D(const PtyProcess);
 
-    return d->pty ? d->pty->masterFd() : -1;
+    return d->masterFd();
 }
 
 int PtyProcess::pid() const
@@ -164,6 +539,13 @@ int PtyProcess::pid() const
     return m_pid;
 }
 
+PtyProcess::Timings PtyProcess::timings() const
+{
+    Q_D(const PtyProcess);
+
+    return d->timings;
+}
+
 /*! Returns the additional environment variables set by setEnvironment() */
 QList<QByteArray> PtyProcess::environment() const
 {
@@ -176,52 +558,15 @@ QByteArray PtyProcess::readAll(bool block)
 {
     Q_D(PtyProcess);
 
-    QByteArray ret;
-    if (!d->inputBuffer.isEmpty()) {
-        // if there is still something in the buffer, we need not block.
-        // we should still try to read any further output, from the fd, though.
-        block = false;
-        ret = d->inputBuffer;
-        d->inputBuffer.resize(0);
-    }
-
-    int flags = fcntl(fd(), F_GETFL);
-    if (flags < 0) {
-        qCCritical(KSU_LOG) << "[" << __FILE__ << ":" << __LINE__ << "] "
-                            << "fcntl(F_GETFL):" << strerror(errno);
-        return ret;
-    }
-    int oflags = flags;
-    if (block) {
-        flags &= ~O_NONBLOCK;
-    } else {
-        flags |= O_NONBLOCK;
-    }
-
-    if ((flags != oflags) && (fcntl(fd(), F_SETFL, flags) < 0)) {
-        // We get an error here when the child process has closed
-        // the file descriptor already.
-        return ret;
-    }
-
-    while (1) {
-        ret.reserve(ret.size() + 0x8000);
-        int nbytes = read(fd(), ret.data() + ret.size(), 0x8000);
-        if (nbytes == -1) {
-            if (errno == EINTR) {
-                continue;
-            } else {
-                break;
-            }
-        }
-        if (nbytes == 0) {
-            break; // nothing available / eof
-        }
+    // if there is still something in the buffer, we need not block.
+    // we should still try to read any further output, from the fd, though.
+    d->readInput(block && d->pendingInput() == 0);
 
-        ret.resize(ret.size() + nbytes);
-        break;
+    QByteArray ret;
+    if (d->pendingInput() > 0) {
+        ret = QByteArray(d->inputBuffer.constData() + d->inputPos, d->pendingInput());
     }
-
+    d->consumeInput(d->pendingInput());
     return ret;
 }
 
@@ -229,19 +574,23 @@ QByteArray PtyProcess::readLine(bool block)
 {
     Q_D(PtyProcess);
 
-    d->inputBuffer = readAll(block);
+    // Only go to the fd if there is no full line buffered yet
+    qsizetype pos = d->inputBuffer.indexOf('\n', d->inputPos);
+    if (pos == -1) {
+        d->readInput(block && d->pendingInput() == 0);
+        pos = d->inputBuffer.indexOf('\n', d->inputPos);
+    }
 
-    int pos;
     QByteArray ret;
-    if (!d->inputBuffer.isEmpty()) {
-        pos = d->inputBuffer.indexOf('\n');
+    if (d->pendingInput() > 0) {
+        const QByteArrayView pending(d->inputBuffer.constData() + d->inputPos, d->pendingInput());
         if (pos == -1) {
             // NOTE: this means we return something even if there in no full line!
-            ret = d->inputBuffer;
-            d->inputBuffer.resize(0);
+            ret = pending.toByteArray();
+            d->consumeInput(pending.size());
         } else {
-            ret = d->inputBuffer.left(pos);
-            d->inputBuffer.remove(0, pos + 1);
+            ret = pending.first(pos - d->inputPos).toByteArray();
+            d->consumeInput(pos - d->inputPos + 1);
         }
     }
 
@@ -250,12 +599,23 @@ QByteArray PtyProcess::readLine(bool block)
 
 void PtyProcess::writeLine(const QByteArray &line, bool addnl)
 {
+    Q_D(PtyProcess);
+
+    // Write the line and its newline at once, with EXTPROC the reader
+    // would otherwise see them in separate reads.
+    struct iovec iov[2];
+    int n = 0;
     if (!line.isEmpty()) {
-        write(fd(), line.constData(), line.length());
+        iov[n].iov_base = const_cast<char *>(line.constData());
+        iov[n].iov_len = line.length();
+        n++;
     }
     if (addnl) {
-        write(fd(), "\n", 1);
+        iov[n].iov_base = const_cast<char *>("\n");
+        iov[n].iov_len = 1;
+        n++;
     }
+    d->writeOutput(iov, n);
 }
 
 void PtyProcess::unreadLine(const QByteArray &line, bool addnl)
@@ -266,67 +626,153 @@ void PtyProcess::unreadLine(const QByteArray &line, bool addnl)
     if (addnl) {
         tmp += '\n';
     }
-    if (!tmp.isEmpty()) {
-        d->inputBuffer.prepend(tmp);
+    if (tmp.isEmpty()) {
+        return;
+    }
+    if (d->inputPos >= tmp.size()) {
+        // Fits into the space that was already consumed
+        d->inputPos -= tmp.size();
+        memcpy(d->inputBuffer.data() + d->inputPos, tmp.constData(), tmp.size());
+    } else {
+        d->inputBuffer.replace(0, d->inputPos, tmp);
+        d->inputPos = 0;
     }
 }
 
+int PtyProcess::waitForOutput(int ms)
+{
+    Q_D(PtyProcess);
+
+    QElapsedTimer timer;
+    timer.start();
+    while (d->pendingInput() == 0) {
+        const int remaining = ms - int(timer.elapsed());
+        if (remaining <= 0) {
+            return 0;
+        }
+        int ret = waitMS(fd(), remaining);
+        if (ret <= 0) {
+            return ret;
+        }
+        // Readable might just mean a control packet. On EOF, let the caller
+        // find out with the next read.
+        if (d->readInput(false) < 0) {
+            return 1;
+        }
+    }
+    return 1;
+}
+
 void PtyProcess::setExitString(const QByteArray &exit)
 {
     m_exitString = exit;
 }
 
 /*
- * Fork and execute the command. This returns in the parent.
+ * The environment of the child: ours, plus the additional variables, minus
+ * the session ones. LC_ALL is set to C for su (to be able to parse
+ * "Password:"), the old value is kept in KDESU_LC_ALL for kdesu_stub.
  */
-int PtyProcess::exec(const QByteArray &command, const QList<QByteArray> &args)
+static QList<QByteArray> childEnvironment(const QList<QByteArray> &extra)
 {
-    Q_D(PtyProcess);
+    auto varName = [](const QByteArray &var) {
+        const qsizetype eq = var.indexOf('=');
+        return eq < 0 ? var : var.left(eq);
+    };
+
+    QMap<QByteArray, QByteArray> vars;
+    for (char **env = environ; *env; ++env) {
+        const QByteArray var(*env);
+        vars.insert(varName(var), var);
+    }
+    for (const QByteArray &var : extra) {
+        // Like putenv(), a name without a value removes the variable
+        if (var.contains('=')) {
+            vars.insert(varName(var), var);
+        } else {
+            vars.remove(var);
+        }
+    }
 
-    int i;
+    vars.remove("KDE_FULL_SESSION");
+    // for : Qt: Session management error
+    vars.remove("SESSION_MANAGER");
+    // QMutex::lock , deadlocks without that.
+    // <thiago> you cannot connect to the user's session bus from another UID
+    vars.remove("DBUS_SESSION_BUS_ADDRESS");
 
-    if (init() < 0) {
-        return -1;
+    const QByteArray oldLcAll = vars.value("LC_ALL").mid(qstrlen("LC_ALL="));
+    if (!oldLcAll.isEmpty()) {
+        vars.insert("KDESU_LC_ALL", "KDESU_LC_ALL=" + oldLcAll);
+    } else {
+        vars.remove("KDESU_LC_ALL");
     }
+    vars.insert("LC_ALL", "LC_ALL=C");
 
-    if ((m_pid = fork()) == -1) {
-        qCCritical(KSU_LOG) << "[" << __FILE__ << ":" << __LINE__ << "] "
-                            << "fork():" << strerror(errno);
+    return vars.values();
+}
+
+/*
+ * Fork and execute the command. This returns in the parent.
+ */
+int PtyProcess::exec(const QByteArray &command, const QList<QByteArray> &args)
+{
+    if (init() < 0) {
         return -1;
     }
+    return spawn(command, args, -1);
+}
 
-    // Parent
-    if (m_pid) {
-        d->pty->closeSlave();
-        return 0;
-    }
+/*
+ * Like exec(), but the child gets one end of a socket pair as stdin, stdout
+ * and stderr instead of a PTY. It runs in a new session without a
+ * controlling terminal. There is no echo, so no need for waitSlave().
+ */
+int PtyProcess::execWithoutPty(const QByteArray &command, const QList<QByteArray> &args)
+{
+    Q_D(PtyProcess);
 
-    // Child
-    if (setupTTY() < 0) {
-        _exit(1);
-    }
+    QElapsedTimer timer;
+    timer.start();
 
-    for (const QByteArray &var : std::as_const(d->env)) {
-        putenv(const_cast<char *>(var.constData()));
-    }
-    unsetenv("KDE_FULL_SESSION");
-    // for : Qt: Session management error
-    unsetenv("SESSION_MANAGER");
-    // QMutex::lock , deadlocks without that.
-    // <thiago> you cannot connect to the user's session bus from another UID
-    unsetenv("DBUS_SESSION_BUS_ADDRESS");
+    delete d->pty;
+    d->pty = nullptr;
+    d->closePidFd();
+    d->closeChannel();
+    d->packetMode = false;
+    d->extProc = false;
+    d->inputBuffer.resize(0);
+    d->inputPos = 0;
+    d->termiosChanged = false;
 
-    // set temporarily LC_ALL to C, for su (to be able to parse "Password:")
-    const QByteArray old_lc_all = qgetenv("LC_ALL");
-    if (!old_lc_all.isEmpty()) {
-        qputenv("KDESU_LC_ALL", old_lc_all);
-    } else {
-        unsetenv("KDESU_LC_ALL");
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        qCCritical(KSU_LOG) << "[" << __FILE__ << ":" << __LINE__ << "] "
+                            << "socketpair():" << strerror(errno);
+        return -1;
     }
-    qputenv("LC_ALL", "C");
+    fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+    fcntl(sv[1], F_SETFD, FD_CLOEXEC);
+    d->channelFd = sv[0];
+    d->timings.ptyOpen = timer.nsecsElapsed();
+
+    const int ret = spawn(command, args, sv[1]);
+    close(sv[1]);
+    return ret;
+}
+
+/*
+ * Start the child on the PTY, or on @p channel if that is not -1.
+ */
+int PtyProcess::spawn(const QByteArray &command, const QList<QByteArray> &args, int channel)
+{
+    Q_D(PtyProcess);
 
-    // From now on, terminal output goes through the tty.
+    QElapsedTimer timer;
+    timer.start();
 
+    // Everything the child needs is prepared here. Between vfork() and
+    // execve() it shares our memory, and may only make system calls.
     QByteArray path;
     if (command.contains('/')) {
         path = command;
@@ -334,26 +780,97 @@ int PtyProcess::exec(const QByteArray &command, const QList<QByteArray> &args)
         QString file = QStandardPaths::findExecutable(QFile::decodeName(command));
         if (file.isEmpty()) {
             qCCritical(KSU_LOG) << "[" << __FILE__ << ":" << __LINE__ << "] " << command << "not found.";
-            _exit(1);
+            return -1;
         }
         path = QFile::encodeName(file);
     }
 
-    const char **argp = (const char **)malloc((args.count() + 2) * sizeof(char *));
-
-    i = 0;
-    argp[i++] = path.constData();
+    std::vector<const char *> argp;
+    argp.reserve(args.count() + 2);
+    argp.push_back(path.constData());
     for (const QByteArray &arg : args) {
-        argp[i++] = arg.constData();
+        argp.push_back(arg.constData());
+    }
+    argp.push_back(nullptr);
+
+    const QList<QByteArray> env = childEnvironment(d->env);
+    std::vector<const char *> envp;
+    envp.reserve(env.count() + 1);
+    for (const QByteArray &var : env) {
+        envp.push_back(var.constData());
+    }
+    envp.push_back(nullptr);
+
+    if (channel < 0) {
+        // Disable OPOST processing. Otherwise, '\n' are (on Linux at least)
+        // translated to '\r\n'.
+        struct ::termios tio;
+        if (!d->pty->tcGetAttr(&tio)) {
+            qCCritical(KSU_LOG) << "[" << __FILE__ << ":" << __LINE__ << "] "
+                                << "tcgetattr():" << strerror(errno);
+            return -1;
+        }
+        tio.c_oflag &= ~OPOST;
+        if (!d->pty->tcSetAttr(&tio)) {
+            qCCritical(KSU_LOG) << "[" << __FILE__ << ":" << __LINE__ << "] "
+                                << "tcsetattr():" << strerror(errno);
+            return -1;
+        }
+    }
+
+    // Keep the signal handlers of the caller from running in the child
+    // while it shares our memory. The child resets them and unblocks.
+    sigset_t allSignals;
+    sigset_t oldMask;
+    sigfillset(&allSignals);
+    pthread_sigmask(SIG_SETMASK, &allSignals, &oldMask);
+
+    // Written by the child if execve() fails, only visible with vfork()
+    volatile int childErrno = 0;
+
+#if HAVE_VFORK
+    m_pid = vfork();
+#else
+    m_pid = fork();
+#endif
+    if (m_pid == 0) {
+        // Child
+        if ((channel < 0 ? setupTTY() : setupChannel(channel)) < 0) {
+            childErrno = errno;
+            _exit(1);
+        }
+        pthread_sigmask(SIG_SETMASK, &oldMask, nullptr);
+
+        // From now on, terminal output goes through the tty.
+        KDESU_TRACE1(exec, path.constData());
+        execve(path.constData(), const_cast<char **>(argp.data()), const_cast<char **>(envp.data()));
+        childErrno = errno;
+        _exit(1);
     }
 
-    argp[i] = nullptr;
+    const int forkErrno = errno;
+    pthread_sigmask(SIG_SETMASK, &oldMask, nullptr);
 
-    execv(path.constData(), const_cast<char **>(argp));
-    qCCritical(KSU_LOG) << "[" << __FILE__ << ":" << __LINE__ << "] "
-                        << "execv(" << path << "):" << strerror(errno);
-    _exit(1);
-    return -1; // Shut up compiler. Never reached.
+    if (m_pid == -1) {
+        qCCritical(KSU_LOG) << "[" << __FILE__ << ":" << __LINE__ << "] "
+                            << "fork():" << strerror(forkErrno);
+        return -1;
+    }
+
+    // Parent
+    KDESU_TRACE1(fork, m_pid);
+    if (childErrno) {
+        qCCritical(KSU_LOG) << "[" << __FILE__ << ":" << __LINE__ << "] "
+                            << "execve(" << path << "):" << strerror(childErrno);
+        waitpid(m_pid, nullptr, 0);
+        return -1;
+    }
+    d->pidFd = openPidFd(m_pid);
+    if (channel < 0) {
+        d->pty->closeSlave();
+    }
+    d->timings.spawn = timer.nsecsElapsed();
+    return 0;
 }
 
 /*
@@ -364,14 +881,24 @@ int PtyProcess::exec(const QByteArray &command, const QList<QByteArray> &args)
  * before writing the password.
  * Note that this is done on the slave fd. While Linux allows tcgetattr() on
  * the master side, Solaris doesn't.
+ * In packet mode, the slave's termios changes are reported on the master, so
+ * we only look at the flags again when one happened. Packet mode ends here.
  */
 int PtyProcess::waitSlave()
 {
     Q_D(PtyProcess);
 
+    if (!d->pty) {
+        // Started with execWithoutPty(), there is no echo
+        return 0;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+
     struct termios tio;
     while (1) {
-        if (!checkPid(m_pid)) {
+        if (!d->packetMode && !checkPid(m_pid)) {
             qCCritical(KSU_LOG) << "process has exited while waiting for password.";
             return -1;
         }
@@ -382,14 +909,64 @@ int PtyProcess::waitSlave()
         }
         if (tio.c_lflag & ECHO) {
             // qDebug() << "[" << __FILE__ << ":" << __LINE__ << "] " << "Echo mode still on.";
-            usleep(10000);
+            if (!d->packetMode) {
+                usleep(10000);
+                continue;
+            }
+            if (waitTermiosChange() < 0) {
+                qCCritical(KSU_LOG) << "process has exited while waiting for password.";
+                return -1;
+            }
             continue;
         }
         break;
     }
+    d->disablePacketMode();
+    KDESU_TRACE1(wait_slave, m_pid);
+    d->timings.waitSlave = timer.nsecsElapsed();
     return 0;
 }
 
+/*
+ * Wait until the master reports a termios change of the slave (packet mode
+ * only). Output that arrives in the meantime is kept in the input buffer.
+ * Returns 0 on a change, -1 when the slave side was closed.
+ */
+int PtyProcess::waitTermiosChange()
+{
+    Q_D(PtyProcess);
+
+    d->termiosChanged = false;
+    while (1) {
+        struct pollfd pfd;
+        pfd.fd = fd();
+        pfd.events = POLLIN | POLLPRI;
+        pfd.revents = 0;
+        // The timeout is only a safety net in case a platform does not
+        // report the change after all.
+        int ret = poll(&pfd, 1, 1000);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            qCCritical(KSU_LOG) << "[" << __FILE__ << ":" << __LINE__ << "] "
+                                << "poll():" << strerror(errno);
+            return -1;
+        }
+        if (ret == 0) {
+            return kill(m_pid, 0) == 0 || errno == EPERM ? 0 : -1;
+        }
+
+        ret = d->readInput(false);
+        if (d->termiosChanged) {
+            return 0;
+        }
+        if (ret < 0) {
+            return -1; // nobody has the slave open anymore
+        }
+    }
+}
+
 int PtyProcess::enableLocalEcho(bool enable)
 {
     Q_D(PtyProcess);
@@ -413,133 +990,200 @@ void PtyProcess::setErase(bool erase)
     m_erase = erase;
 }
 
+/*
+ * Copy output to stdout, and terminate the child when a line of output
+ * matches `m_exitString'.
+ */
+void PtyProcess::handleChildOutput(const QByteArray &output)
+{
+    Q_D(PtyProcess);
+
+    if (m_terminal) {
+        fwrite(output.constData(), output.size(), 1, stdout);
+        fflush(stdout);
+    }
+    if (!m_exitString.isEmpty()) {
+        // match exit string only at line starts
+        QByteArray &remainder = d->exitRemainder;
+        remainder += output;
+        while (remainder.length() >= m_exitString.length()) {
+            if (remainder.startsWith(m_exitString)) {
+                kill(m_pid, SIGTERM);
+                remainder.remove(0, m_exitString.length());
+            }
+            int off = remainder.indexOf('\n');
+            if (off < 0) {
+                break;
+            }
+            remainder.remove(0, off + 1);
+        }
+    }
+}
+
+/*
+ * Reap the child if it has exited. Returns NotExited if it is still
+ * running, otherwise the result of waitForChild().
+ */
+int PtyProcess::reapChild()
+{
+    int ret = checkPidExited(m_pid);
+    if (ret != NotExited) {
+        KDESU_TRACE2(child_exit, m_pid, ret);
+    }
+    if (ret == Error) {
+        return errno == ECHILD ? 0 : 1;
+    } else if (ret == Killed) {
+        return 0;
+    }
+    return ret;
+}
+
 /*
  * Copy output to stdout until the child process exits, or a line of output
  * matches `m_exitString'.
  * We have to use waitpid() to test for exit. Merely waiting for EOF on the
  * pty does not work, because the target process may have children still
- * attached to the terminal.
+ * attached to the terminal. Where available, a pidfd of the child wakes us
+ * up as soon as it exits, otherwise we check every 100 ms.
  */
 int PtyProcess::waitForChild()
 {
-    fd_set fds;
-    FD_ZERO(&fds);
-    QByteArray remainder;
+    Q_D(PtyProcess);
+
+    QElapsedTimer timer;
+    timer.start();
+    auto recordTiming = qScopeGuard([d, &timer] {
+        d->timings.child = timer.nsecsElapsed();
+    });
+
+    // In case the password exchange ended before waitSlave() did
+    d->disablePacketMode();
+    d->exitRemainder.clear();
+    bool masterOpen = true;
 
     while (1) {
-        FD_SET(fd(), &fds);
-
-        // specify timeout to make sure select() does not block, even if the
-        // process is dead / non-responsive. It does not matter if we abort too
-        // early. In that case 0 is returned, and we'll try again in the next
-        // iteration. (As long as we don't consistently time out in each iteration)
-        timeval timeout;
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 100000;
-        int ret = select(fd() + 1, &fds, nullptr, nullptr, &timeout);
+        // poll() ignores negative fds, so this also works without a pidfd
+        // and once the slave side has been closed by everybody.
+        struct pollfd pfd[2];
+        pfd[0].fd = masterOpen ? fd() : -1;
+        pfd[0].events = POLLIN;
+        pfd[0].revents = 0;
+        pfd[1].fd = d->pidFd;
+        pfd[1].events = POLLIN;
+        pfd[1].revents = 0;
+
+        // Without a pidfd, specify a timeout to make sure poll() does not
+        // block, even if the process is dead / non-responsive. It does not
+        // matter if we abort too early. In that case 0 is returned, and we'll
+        // try again in the next iteration.
+        int ret = poll(pfd, 2, d->pidFd >= 0 ? -1 : 100);
         if (ret == -1) {
             if (errno != EINTR) {
                 qCCritical(KSU_LOG) << "[" << __FILE__ << ":" << __LINE__ << "] "
-                                    << "select():" << strerror(errno);
+                                    << "poll():" << strerror(errno);
                 return -1;
             }
             ret = 0;
         }
 
-        if (ret) {
-            for (;;) {
-                QByteArray output = readAll(false);
-                if (output.isEmpty()) {
-                    break;
-                }
-                if (m_terminal) {
-                    fwrite(output.constData(), output.size(), 1, stdout);
-                    fflush(stdout);
-                }
-                if (!m_exitString.isEmpty()) {
-                    // match exit string only at line starts
-                    remainder += output;
-                    while (remainder.length() >= m_exitString.length()) {
-                        if (remainder.startsWith(m_exitString)) {
-                            kill(m_pid, SIGTERM);
-                            remainder.remove(0, m_exitString.length());
-                        }
-                        int off = remainder.indexOf('\n');
-                        if (off < 0) {
-                            break;
-                        }
-                        remainder.remove(0, off + 1);
-                    }
-                }
+        if (pfd[0].revents & POLLIN) {
+            const QByteArray output = readAll(false);
+            if (!output.isEmpty()) {
+                handleChildOutput(output);
             }
         }
+        if (pfd[0].revents & (POLLHUP | POLLERR | POLLNVAL)) {
+            // The child may have left descendants that still run, but none of
+            // them has the tty open anymore. Only wait for the child now.
+            masterOpen = false;
+        }
 
-        ret = checkPidExited(m_pid);
-        if (ret == Error) {
-            if (errno == ECHILD) {
-                return 0;
-            } else {
-                return 1;
-            }
-        } else if (ret == Killed) {
-            return 0;
-        } else if (ret == NotExited) {
-            continue; // keep checking
-        } else {
+        ret = reapChild();
+        if (ret != NotExited) {
             return ret;
         }
     }
 }
 
+/*
+ * Close all file descriptors from @p lowFd on. Used in the child after
+ * vfork(), so it must only make system calls.
+ */
+static int closeFdsFrom(int lowFd)
+{
+#if HAVE_CLOSE_RANGE
+    if (close_range(lowFd, ~0U, 0) == 0) {
+        return 0;
+    }
+#elif defined(SYS_close_range)
+    if (syscall(SYS_close_range, lowFd, ~0U, 0) == 0) {
+        return 0;
+    }
+#endif
+
+    // close_range isn't available, close them one by one
+    struct rlimit rlp;
+    if (getrlimit(RLIMIT_NOFILE, &rlp) < 0) {
+        return -1;
+    }
+    for (int i = lowFd; i < (int)rlp.rlim_cur; i++) {
+        close(i);
+    }
+    return 0;
+}
+
+// Reset signal handlers
+static void resetSignals()
+{
+    for (int sig = 1; sig < NSIG; sig++) {
+        signal(sig, SIG_DFL);
+    }
+    signal(SIGHUP, SIG_IGN);
+}
+
 /*
  * SetupTTY: Creates a new session. The filedescriptor "fd" should be
  * connected to the tty. It is closed after the tty is reopened to make it
  * our controlling terminal. This way the tty is always opened at least once
  * so we'll never get EIO when reading from it.
+ * This runs in the child between vfork() and execve(). No allocations and
+ * no logging here, errors are reported to the parent through errno.
  */
 int PtyProcess::setupTTY()
 {
     Q_D(PtyProcess);
 
-    // Reset signal handlers
-    for (int sig = 1; sig < NSIG; sig++) {
-        signal(sig, SIG_DFL);
-    }
-    signal(SIGHUP, SIG_IGN);
+    resetSignals();
 
     d->pty->setCTty();
 
     // Connect stdin, stdout and stderr
     int slave = d->pty->slaveFd();
-    dup2(slave, 0);
-    dup2(slave, 1);
-    dup2(slave, 2);
+    if (dup2(slave, 0) < 0 || dup2(slave, 1) < 0 || dup2(slave, 2) < 0) {
+        return -1;
+    }
 
     // Close all file handles
     // XXX this caused problems in KProcess - not sure why anymore. -- ???
     // Because it will close the start notification pipe. -- ossi
-    struct rlimit rlp;
-    getrlimit(RLIMIT_NOFILE, &rlp);
-    for (int i = 3; i < (int)rlp.rlim_cur; i++) {
-        close(i);
-    }
+    return closeFdsFrom(3);
+}
 
-    // Disable OPOST processing. Otherwise, '\n' are (on Linux at least)
-    // translated to '\r\n'.
-    struct ::termios tio;
-    if (tcgetattr(0, &tio) < 0) {
-        qCCritical(KSU_LOG) << "[" << __FILE__ << ":" << __LINE__ << "] "
-                            << "tcgetattr():" << strerror(errno);
-        return -1;
-    }
-    tio.c_oflag &= ~OPOST;
-    if (tcsetattr(0, TCSANOW, &tio) < 0) {
-        qCCritical(KSU_LOG) << "[" << __FILE__ << ":" << __LINE__ << "] "
-                            << "tcsetattr():" << strerror(errno);
+/*
+ * Like setupTTY(), for a child that talks to us through the socket @p fd.
+ * It gets a new session without a controlling terminal.
+ */
+int PtyProcess::setupChannel(int fd)
+{
+    resetSignals();
+
+    setsid();
+
+    if (dup2(fd, 0) < 0 || dup2(fd, 1) < 0 || dup2(fd, 2) < 0) {
         return -1;
     }
 
-    return 0;
+    return closeFdsFrom(3);
 }
 
 void PtyProcess::virtual_hook(int id, void *data)
@@ -22,6 +22,7 @@
 
 namespace KDESu
 {
+class ExecJobPrivate;
 class PtyProcessPrivate;
 
 /*!
@@ -51,6 +52,36 @@ public:
         Killed = -3,
     };
 
+    /*!
+     * \struct KDESu::PtyProcess::Timings
+     * \inmodule KDESu
+     *
+     * \brief Durations of the phases of the last launch.
+     *
+     * All durations are in nanoseconds, measured with a monotonic clock.
+     * Phases that did not run are -1.
+     *
+     * \since 6.28
+     */
+    struct Timings {
+        /*! Allocation and setup of the PTY pair. */
+        qint64 ptyOpen = -1;
+        /*! From fork() until the parent continues. */
+        qint64 spawn = -1;
+        /*! Prompt detection and password entry, including waitSlave. */
+        qint64 prompt = -1;
+        /*! Waiting for the slave to turn off ECHO, see waitSlave(). */
+        qint64 waitSlave = -1;
+        /*! Parameter exchange with kdesu_stub. */
+        qint64 stub = -1;
+        /*! Waiting for the X11 authentication cookie, which is looked up while su runs. */
+        qint64 cookie = -1;
+        /*! Waiting for the child to exit, see waitForChild(). */
+        qint64 child = -1;
+        /*! The whole SuProcess::exec() or SshProcess::exec() call. */
+        qint64 total = -1;
+    };
+
     PtyProcess();
     virtual ~PtyProcess();
 
@@ -159,6 +190,29 @@ public:
      */
     int pid() const;
 
+    /*!
+     * Returns the durations of the phases of the last launch.
+     *
+     * The same breakdown is logged as a single line to the
+     * "kf.su.timing" logging category at debug level.
+     *
+     * \since 6.28
+     */
+    Timings timings() const;
+
+    /*!
+     * Keeps up to \a size PTY pairs open and ready for the next launches
+     * of any PtyProcess in this process, so that exec() does not have to
+     * allocate one. Pairs that are handed out are replaced in the
+     * background. A pair is never reused once a child has had it.
+     *
+     * The pool is disabled by default. A \a size of 0 disables it and
+     * closes the pairs that are waiting in it.
+     *
+     * \since 6.28
+     */
+    static void setPtyPoolSize(int size);
+
     /*
      * This is a collection of static functions that can be
      * used for process control inside kdesu. I'd suggest
@@ -206,6 +260,20 @@ protected:
     virtual void virtual_hook(int id, void *data);
     QList<QByteArray> environment() const;
 
+    /*
+     * Like waitMS() on fd(), but also considers already buffered output
+     * and ignores PTY control packets. Returns 1 if there is output to be
+     * read, 0 on timeout and -1 on error.
+     */
+    KDESU_NO_EXPORT int waitForOutput(int ms);
+
+    /*
+     * Like exec(), but the child gets one end of a socket pair as its
+     * stdin, stdout and stderr instead of a PTY. fd() is the other end.
+     * For commands that take a password on stdin, like sudo -S.
+     */
+    KDESU_NO_EXPORT int execWithoutPty(const QByteArray &command, const QList<QByteArray> &args);
+
     // KF6 TODO: move to PtyProcessPrivate
     bool m_erase;
     bool m_terminal; /* Indicates running in a terminal, causes additional
@@ -217,7 +285,14 @@ protected:
 
 private:
     KDESU_NO_EXPORT int init();
+    KDESU_NO_EXPORT int spawn(const QByteArray &command, const QList<QByteArray> &args, int channel);
     KDESU_NO_EXPORT int setupTTY();
+    KDESU_NO_EXPORT int setupChannel(int fd);
+    KDESU_NO_EXPORT int waitTermiosChange();
+    KDESU_NO_EXPORT void handleChildOutput(const QByteArray &output);
+    KDESU_NO_EXPORT int reapChild();
+
+    friend class ExecJobPrivate;
 
 protected:
     std::unique_ptr<PtyProcessPrivate> const d_ptr;
@@ -9,11 +9,16 @@
 #ifndef KDESUPTYPROCESS_P_H
 #define KDESUPTYPROCESS_P_H
 
+#include "ptyprocess.h"
+
 #include <KPty>
 
 #include <QByteArray>
+#include <QElapsedTimer>
 #include <QList>
 
+struct iovec;
+
 namespace KDESu
 {
 class PtyProcessPrivate
@@ -24,14 +29,77 @@ public:
     }
     virtual ~PtyProcessPrivate()
     {
+        closePidFd();
+        closeChannel();
         delete pty;
     }
 
+    void closePidFd();
+    void closeChannel();
+    // Makes a child without a PTY read EOF, the equivalent of closing the
+    // terminal. No-op on a PTY.
+    void closeInput();
+    // Puts the master into packet mode and sets EXTPROC on the slave, if
+    // wantPacketMode is set.
+    void enablePacketMode();
+    // Leaves packet mode and clears EXTPROC, once the password exchange is
+    // over.
+    void disablePacketMode();
+    // Clears EXTPROC on the slave again if we set it, su restores it with
+    // the rest of the termios it saved.
+    void clearExtProc();
+
+    // The fd the child is talked to through
+    int masterFd() const
+    {
+        return channelFd >= 0 ? channelFd : (pty ? pty->masterFd() : -1);
+    }
+
+    // Starts a new set of phase timings.
+    void resetTimings();
+    // Records the total duration and logs the timings of the launch.
+    void finishTimings(const QElapsedTimer &total, const char *backend);
+
+    // Number of buffered bytes not yet handed out
+    qsizetype pendingInput() const
+    {
+        return inputBuffer.size() - inputPos;
+    }
+    void consumeInput(qsizetype count);
+    // Reads whatever is available on the master into the input buffer. If
+    // @p block is set, waits until there is at least some output. Returns
+    // the number of bytes added, or -1 on EOF or error.
+    int readInput(bool block);
+    // Writes all of @p iov to the master, waiting while it is full.
+    bool writeOutput(struct iovec *iov, int count);
+
     QList<QByteArray> env;
     KPty *pty = nullptr;
+    // Output of the child. Everything before inputPos has been consumed
+    // already and is only dropped when reading more, to avoid moving the
+    // rest of the buffer on every readLine().
     QByteArray inputBuffer;
+    qsizetype inputPos = 0;
+    // Set when a termios change of the slave was seen in packet mode
+    bool termiosChanged = false;
+    // Output since the last line start, for matching the exit string
+    QByteArray exitRemainder;
     // Whether to keep echo on after PTY creation
     bool wantLocalEcho = true;
+    // Whether to use packet mode during the password exchange. Only
+    // SuProcess and SshProcess do, a plain PtyProcess keeps a normal PTY.
+    bool wantPacketMode = false;
+    // Whether the master is in packet mode (TIOCPKT) and the slave has
+    // EXTPROC set, so termios changes of the slave are reported on the
+    // master.
+    bool packetMode = false;
+    // Whether EXTPROC was set on the slave of this PTY
+    bool extProc = false;
+    // pidfd of the child, -1 if not supported
+    int pidFd = -1;
+    // Socket to a child that runs without a PTY, see PtyProcess::execWithoutPty()
+    int channelFd = -1;
+    PtyProcess::Timings timings;
 };
 
 }
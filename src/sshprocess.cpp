@@ -10,36 +10,29 @@
 #include "sshprocess.h"
 
 #include "kcookie_p.h"
-#include "stubprocess_p.h"
+#include "kdesutrace_p.h"
+#include "sshprocess_p.h"
 #include <ksu_debug.h>
 
 #include <signal.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <QElapsedTimer>
+#include <QScopeGuard>
+
 extern int kdesuDebugArea();
 
 namespace KDESu
 {
 using namespace KDESuPrivate;
 
-class SshProcessPrivate : public StubProcessPrivate
-{
-public:
-    SshProcessPrivate(const QByteArray &host)
-        : host(host)
-        , stub("kdesu_stub")
-    {
-    }
-    QByteArray prompt;
-    QByteArray host;
-    QByteArray error;
-    QByteArray stub;
-};
-
 SshProcess::SshProcess(const QByteArray &host, const QByteArray &user, const QByteArray &command)
     : StubProcess(*new SshProcessPrivate(host))
 {
+    Q_D(SshProcess);
+
+    d->wantPacketMode = true;
     m_user = user;
     m_command = command;
     srand(time(nullptr));
@@ -71,14 +64,14 @@ int SshProcess::checkNeedPassword()
     return exec(nullptr, 2);
 }
 
-int SshProcess::exec(const char *password, int check)
+/*
+ * Start ssh with kdesu_stub on the remote host. Returns 0 on success,
+ * otherwise the value for exec() to return.
+ */
+int SshProcess::start(int check)
 {
     Q_D(SshProcess);
 
-    if (check) {
-        setTerminal(true);
-    }
-
     QList<QByteArray> args;
     args += "-l";
     args += m_user;
@@ -90,8 +83,32 @@ int SshProcess::exec(const char *password, int check)
     if (StubProcess::exec("ssh", args) < 0) {
         return check ? SshNotFound : -1;
     }
+    return 0;
+}
 
+int SshProcess::exec(const char *password, int check)
+{
+    Q_D(SshProcess);
+
+    QElapsedTimer total;
+    total.start();
+    d->resetTimings();
+    auto finishTimings = qScopeGuard([d, &total] {
+        d->finishTimings(total, "ssh");
+    });
+
+    if (check) {
+        setTerminal(true);
+    }
+
+    if (int ret = start(check)) {
+        return ret;
+    }
+
+    QElapsedTimer promptTimer;
+    promptTimer.start();
     int ret = converseSsh(password, check);
+    d->timings.prompt = promptTimer.nsecsElapsed();
     if (ret < 0) {
         if (!check) {
             qCCritical(KSU_LOG) << "[" << __FILE__ << ":" << __LINE__ << "] "
@@ -164,70 +181,83 @@ int SshProcess::converseSsh(const char *password, int check)
 {
     Q_D(SshProcess);
 
+    d->converseState = 0;
+    while (1) {
+        const int ret = converseSshLine(readLine(), check);
+        if (ret == ConverseWritePassword) {
+            if (waitSlave()) {
+                return -1;
+            }
+            writeLine(QByteArray::fromRawData(password, qstrlen(password)));
+            KDESU_TRACE1(password_written, m_pid);
+        } else if (ret != ConverseContinue) {
+            return ret;
+        }
+    }
+}
+
+/*
+ * Handle one line of the conversation with ssh. Returns the same values
+ * as converseSsh(), ConverseContinue or ConverseWritePassword.
+ */
+int SshProcess::converseSshLine(const QByteArray &line, int check)
+{
+    Q_D(SshProcess);
+
     unsigned i;
     unsigned j;
     unsigned colon;
 
-    QByteArray line;
-    int state = 0;
+    const uint len = line.length();
+    if (line.isNull()) {
+        return -1;
+    }
 
-    while (state < 2) {
-        line = readLine();
-        const uint len = line.length();
-        if (line.isNull()) {
-            return -1;
+    switch (d->converseState) {
+    case 0:
+        // Check for "kdesu_stub" header.
+        if (line == "kdesu_stub") {
+            unreadLine(line);
+            return 0;
         }
 
-        switch (state) {
-        case 0:
-            // Check for "kdesu_stub" header.
-            if (line == "kdesu_stub") {
-                unreadLine(line);
-                return 0;
+        // Match "Password: " with the regex ^[^:]+:[\w]*$.
+        for (i = 0, j = 0, colon = 0; i < len; ++i) {
+            if (line[i] == ':') {
+                j = i;
+                colon++;
+                continue;
             }
-
-            // Match "Password: " with the regex ^[^:]+:[\w]*$.
-            for (i = 0, j = 0, colon = 0; i < len; ++i) {
-                if (line[i] == ':') {
-                    j = i;
-                    colon++;
-                    continue;
-                }
-                if (!isspace(line[i])) {
-                    j++;
-                }
+            if (!isspace(line[i])) {
+                j++;
             }
-            if ((colon == 1) && (line[j] == ':')) {
-                if (check == 2) {
-                    d->prompt = line;
-                    return SshNeedsPassword;
-                }
-                if (waitSlave()) {
-                    return -1;
-                }
-                write(fd(), password, strlen(password));
-                write(fd(), "\n", 1);
-                state++;
-                break;
+        }
+        if ((colon == 1) && (line[j] == ':')) {
+            KDESU_TRACE1(prompt, line.constData());
+            if (check == 2) {
+                d->prompt = line;
+                return SshNeedsPassword;
             }
+            d->converseState++;
+            return ConverseWritePassword;
+        }
 
-            // Warning/error message.
-            d->error += line;
-            d->error += '\n';
-            if (m_terminal) {
-                fprintf(stderr, "ssh: %s\n", line.constData());
-            }
-            break;
+        // Warning/error message.
+        d->error += line;
+        d->error += '\n';
+        if (m_terminal) {
+            fprintf(stderr, "ssh: %s\n", line.constData());
+        }
+        break;
 
-        case 1:
-            if (line.isEmpty()) {
-                state++;
-                break;
-            }
-            return -1;
+    case 1:
+        if (line.isEmpty()) {
+            d->converseState++;
+            return 0;
         }
+        return -1;
     }
-    return 0;
+    return ConverseContinue;
 }
 
 // Display redirection is handled by ssh natively.
@@ -14,6 +14,7 @@
 
 namespace KDESu
 {
+class ExecJobPrivate;
 class SshProcessPrivate;
 
 /*!
@@ -90,7 +91,11 @@ protected:
     QByteArray displayAuth() override;
 
 private:
+    KDESU_NO_EXPORT int start(int check);
     KDESU_NO_EXPORT int converseSsh(const char *password, int check);
+    KDESU_NO_EXPORT int converseSshLine(const QByteArray &line, int check);
+
+    friend class ExecJobPrivate;
 
 private:
     Q_DECLARE_PRIVATE(SshProcess)
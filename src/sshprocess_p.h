@@ -0,0 +1,33 @@
+/*
+    This file is part of the KDE project, module kdesu.
+    SPDX-FileCopyrightText: 2000 Geert Jansen <jansen@kde.org>
+
+    SPDX-License-Identifier: GPL-2.0-only
+*/
+
+#ifndef KDESUSSHPROCESS_P_H
+#define KDESUSSHPROCESS_P_H
+
+#include "stubprocess_p.h"
+
+namespace KDESu
+{
+class SshProcessPrivate : public StubProcessPrivate
+{
+public:
+    SshProcessPrivate(const QByteArray &host)
+        : host(host)
+        , stub("kdesu_stub")
+    {
+    }
+    QByteArray prompt;
+    QByteArray host;
+    QByteArray error;
+    QByteArray stub;
+    // 0: waiting for the prompt, 1: password written, 2: done
+    int converseState = 0;
+};
+
+}
+
+#endif
@@ -9,6 +9,7 @@
 
 #include "stubprocess.h"
 #include "kcookie_p.h"
+#include "kdesutrace_p.h"
 #include "stubprocess_p.h"
 
 #include <config-kdesu.h>
@@ -16,6 +17,11 @@
 
 #include <unistd.h>
 
+#include <algorithm>
+
+#include <QElapsedTimer>
+#include <QScopeGuard>
+
 extern int kdesuDebugArea();
 
 namespace KDESu
@@ -33,6 +39,7 @@ StubProcess::StubProcess(StubProcessPrivate &dd)
     m_user = "root";
     m_scheduler = SchedNormal;
     m_priority = 50;
+    // Looked up when kdesu_stub asks for it, see fetchCookie()
     m_cookie = new KCookie;
     m_XOnly = true;
 }
@@ -44,7 +51,26 @@ StubProcess::~StubProcess()
 
 void StubProcess::setCommand(const QByteArray &command)
 {
+    Q_D(StubProcess);
+
     m_command = command;
+    d->arguments.clear();
+}
+
+void StubProcess::setArguments(const QList<QByteArray> &arguments)
+{
+    Q_D(StubProcess);
+
+    d->arguments = arguments;
+
+    // For stubs that only know the command, and for display
+    m_command.clear();
+    for (const QByteArray &arg : arguments) {
+        if (!m_command.isEmpty()) {
+            m_command += ' ';
+        }
+        m_command += '\'' + QByteArray(arg).replace('\'', "'\\''") + '\'';
+    }
 }
 
 void StubProcess::setUser(const QByteArray &user)
@@ -73,24 +99,167 @@ void StubProcess::setScheduler(int sched)
     m_scheduler = sched;
 }
 
-void StubProcess::writeString(const QByteArray &str)
+void StubProcess::setDeadline(qint64 runtime, qint64 deadline, qint64 period)
 {
-    QByteArray out;
-    out.reserve(str.size() + 8);
-    for (const uchar c : str) {
-        if (c < 32) {
-            out.append('\\');
-            out.append(c + '@');
-        } else if (c == '\\') {
-            out.append('\\');
-            out.append('/');
-        } else {
-            out.append(c);
+    Q_D(StubProcess);
+
+    d->deadlineRuntime = runtime;
+    d->deadlineDeadline = deadline;
+    d->deadlinePeriod = period;
+}
+
+void StubProcess::setCpuAffinity(const QList<int> &cpus)
+{
+    Q_D(StubProcess);
+
+    d->cpuAffinity = cpus;
+}
+
+void StubProcess::setNumaPolicy(NumaPolicy policy, const QList<int> &nodes)
+{
+    Q_D(StubProcess);
+
+    d->numaPolicy = policy;
+    d->numaNodes = nodes;
+}
+
+void StubProcess::setIoPriority(IoPriorityClass ioClass, int level)
+{
+    Q_D(StubProcess);
+
+    d->ioClass = ioClass;
+    d->ioLevel = qBound(0, level, 7);
+}
+
+void StubProcess::setOomScoreAdjust(int adjust)
+{
+    Q_D(StubProcess);
+
+    d->oomScoreAdjust = qBound(-1000, adjust, 1000);
+}
+
+void StubProcess::setCgroup(const QByteArray &parent)
+{
+    Q_D(StubProcess);
+
+    d->cgroupParent = parent;
+}
+
+void StubProcess::setCgroupLimit(CgroupLimit limit, const QByteArray &value)
+{
+    Q_D(StubProcess);
+
+    if (limit >= CgroupCpuMax && limit <= CgroupPidsMax) {
+        d->cgroupLimits[limit] = value;
+    }
+}
+
+QByteArray StubProcess::cgroupPath() const
+{
+    Q_D(const StubProcess);
+
+    return d->cgroupPath;
+}
+
+bool StubProcessPrivate::needsRoot() const
+{
+    return ioClass == StubProcess::IoRealtime || oomScoreAdjust.value_or(0) < 0;
+}
+
+// "1,2,3", the lists of kdesu_stub
+static QByteArray joinNumbers(const QList<int> &numbers)
+{
+    QByteArray ret;
+    for (const int number : numbers) {
+        if (!ret.isEmpty()) {
+            ret += ',';
         }
+        ret += QByteArray::number(number);
     }
+    return ret;
+}
+
+/*
+ * Escapes control characters, DEL and backslashes, see dequote() in
+ * kdesu_stub. The terminal would otherwise act on them. Runs without
+ * special characters are copied in one go.
+ */
+static void appendQuoted(QByteArray &out, QByteArrayView str)
+{
+    const auto isSpecial = [](uchar c) {
+        return c < 32 || c == 127 || c == '\\';
+    };
+
+    out.reserve(out.size() + str.size() + 8);
+    auto it = str.begin();
+    while (it != str.end()) {
+        const auto special = std::find_if(it, str.end(), isSpecial);
+        out.append(QByteArrayView(it, special));
+        if (special == str.end()) {
+            break;
+        }
+        const uchar c = *special;
+        out.append('\\');
+        out.append(c == '\\' ? '/' : char(c + '@'));
+        it = special + 1;
+    }
+}
+
+/*
+ * Appends a parameter for version 2 of the stub protocol: "name <length>"
+ * and the quoted value, split into lines so none gets near the 4096 byte
+ * line limit of the terminal.
+ */
+static void appendParameter(QByteArray &out, const char *name, const QByteArray &value)
+{
+    static const qsizetype chunkSize = 1024;
+
+    QByteArray quoted;
+    appendQuoted(quoted, value);
+
+    out += name;
+    out += ' ';
+    out += QByteArray::number(quoted.size());
+    out += '\n';
+    for (qsizetype pos = 0; pos < quoted.size(); pos += chunkSize) {
+        out += QByteArrayView(quoted).mid(pos, chunkSize);
+        out += '\n';
+    }
+}
+
+void StubProcess::writeString(const QByteArray &str)
+{
+    QByteArray out;
+    appendQuoted(out, str);
     writeLine(out);
 }
 
+// The newest protocol version, offered in the answer to the header
+static const int StubProtocolVersion = 2;
+
+// What a version 2 stub is sent in one go, besides the environment
+static const char *const stubParameterNames[] = {
+    "display",
+    "display_auth",
+    "command",
+    "path",
+    "xwindows_only",
+    "user",
+    "priority",
+    "scheduler",
+    "app_startup_id",
+    // Optional, empty means unset
+    "cpu_affinity",
+    "numa_policy",
+    "io_priority",
+    "oom_score_adj",
+    "cgroup",
+    "cgroup_cpu_max",
+    "cgroup_memory_max",
+    "cgroup_io_max",
+    "cgroup_pids_max",
+};
+
 /*
  * Map pid_t to a signed integer type that makes sense for QByteArray;
  * only the most common sizes 16 bit and 32 bit are special-cased.
@@ -116,109 +285,236 @@ struct PIDType<4> {
 
 int StubProcess::converseStub(int check)
 {
-    QByteArray line;
-    QByteArray tmp;
+    Q_D(StubProcess);
+
+    QElapsedTimer timer;
+    timer.start();
+    auto recordTiming = qScopeGuard([d, &timer] {
+        d->timings.stub = timer.nsecsElapsed();
+    });
 
+    d->stubHeaderSeen = false;
+    d->cgroupPath.clear();
     while (1) {
-        line = readLine();
-        if (line.isNull()) {
-            return -1;
+        const int ret = converseStubLine(readLine(), check);
+        if (ret != ConverseContinue) {
+            return ret;
         }
+    }
+}
+
+/*
+ * Handle one line of the conversation with kdesu_stub. Returns the same
+ * values as converseStub(), or ConverseContinue.
+ */
+int StubProcess::converseStubLine(const QByteArray &line, int check)
+{
+    Q_D(StubProcess);
+
+    QByteArray tmp;
 
+    if (line.isNull()) {
+        return -1;
+    }
+
+    if (!d->stubHeaderSeen) {
         if (line == "kdesu_stub") {
+            KDESU_TRACE1(stub_request, line.constData());
+            // su has restored the terminal, the command gets it without
+            // EXTPROC
+            d->clearExtProc();
             // This makes parsing a lot easier.
             enableLocalEcho(false);
             if (check) {
                 writeLine("stop");
             } else {
-                writeLine("ok");
+                // Offer version 2 of the protocol. Old stubs only look for
+                // "stop" and go on asking one parameter at a time.
+                writeLine("ok " + QByteArray::number(StubProtocolVersion));
             }
-            break;
+            d->stubHeaderSeen = true;
         }
+        return ConverseContinue;
     }
 
-    while (1) {
-        line = readLine();
-        if (line.isNull()) {
-            return -1;
+    KDESU_TRACE1(stub_request, line.constData());
+
+    if (line == "params") {
+        // Version 2: all parameters and the environment in one block,
+        // ended by an empty line
+        QByteArray block;
+        for (const char *name : stubParameterNames) {
+            appendParameter(block, name, *stubParameter(name));
+        }
+        // Run without a shell
+        for (const auto &arg : std::as_const(d->arguments)) {
+            appendParameter(block, "argv", arg);
+        }
+        const QList<QByteArray> env = environment();
+        for (const auto &var : env) {
+            appendParameter(block, "environment", var);
         }
+        writeLine(block);
+    } else if (line.startsWith("cgroup ")) {
+        // The stub has moved itself into the cgroup of setCgroup()
+        d->cgroupPath = line.mid(7);
+    } else if (const std::optional<QByteArray> value = stubParameter(line)) {
+        if (line == "command") {
+            writeString(*value);
+        } else {
+            writeLine(*value);
+        }
+    } else if (line == "app_start_pid") { // obsolete
+        // Force the pid_t returned from getpid() into
+        // something QByteArray understands; avoids ambiguity
+        // between short and unsigned short in particular.
+        tmp.setNum((PIDType<sizeof(pid_t)>::PID_t)(getpid()));
+        writeLine(tmp);
+    } else if (line == "environment") { // additional env vars
+        const QList<QByteArray> env = environment();
+        for (const auto &var : env) {
+            writeString(var);
+        }
+        writeLine("");
+    } else if (line == "end") {
+        KDESU_TRACE1(stub_done, 0);
+        return 0;
+    } else if (line.startsWith("kdesu_stub: ")) {
+        // The stub gave up, e.g. on a cgroup it could not set up. That
+        // is an error, not a wrong password.
+        qCCritical(KSU_LOG) << "[" << __FILE__ << ":" << __LINE__ << "] " << line;
+        KDESU_TRACE1(stub_done, -1);
+        return -1;
+    } else {
+        qCWarning(KSU_LOG) << "[" << __FILE__ << ":" << __LINE__ << "] "
+                           << "Unknown request:" << line;
+        KDESU_TRACE1(stub_done, 1);
+        return 1;
+    }
+
+    return ConverseContinue;
+}
 
-        if (line == "display") {
-            writeLine(display());
-        } else if (line == "display_auth") {
+/*
+ * The value of the kdesu_stub parameter @p name, unquoted, or nothing if
+ * there is no such parameter.
+ */
+std::optional<QByteArray> StubProcess::stubParameter(const QByteArray &name)
+{
+    Q_D(StubProcess);
+
+    if (name == "display" || name == "display_auth") {
+        // The cookie may still be looked up in the background
+        QElapsedTimer timer;
+        timer.start();
+        QByteArray value;
+        if (name == "display") {
+            value = display();
+        } else {
 #if HAVE_X11
-            writeLine(displayAuth());
-#else
-            writeLine("");
+            value = displayAuth();
 #endif
-        } else if (line == "command") {
-            writeString(m_command);
-        } else if (line == "path") {
-            QByteArray path = qgetenv("PATH");
-            if (!path.isEmpty() && path[0] == ':') {
-                path = path.mid(1);
-            }
-            if (m_user == "root") {
-                if (!path.isEmpty()) {
-                    path = "/sbin:/bin:/usr/sbin:/usr/bin:" + path;
-                } else {
-                    path = "/sbin:/bin:/usr/sbin:/usr/bin";
-                }
-            }
-            writeLine(path);
-        } else if (line == "user") {
-            writeLine(m_user);
-        } else if (line == "priority") {
-            tmp.setNum(m_priority);
-            writeLine(tmp);
-        } else if (line == "scheduler") {
-            if (m_scheduler == SchedRealtime) {
-                writeLine("realtime");
-            } else {
-                writeLine("normal");
-            }
-        } else if (line == "xwindows_only") {
-            if (m_XOnly) {
-                writeLine("no");
+        }
+        if (d->timings.cookie < 0) {
+            d->timings.cookie = 0;
+        }
+        d->timings.cookie += timer.nsecsElapsed();
+        return value;
+    } else if (name == "command") {
+        return m_command;
+    } else if (name == "path") {
+        QByteArray path = qgetenv("PATH");
+        if (!path.isEmpty() && path[0] == ':') {
+            path = path.mid(1);
+        }
+        if (m_user == "root") {
+            if (!path.isEmpty()) {
+                path = "/sbin:/bin:/usr/sbin:/usr/bin:" + path;
             } else {
-                writeLine("yes");
-            }
-        } else if (line == "app_startup_id") {
-            const QList<QByteArray> env = environment();
-            QByteArray tmp;
-            static const char startup_env[] = "DESKTOP_STARTUP_ID=";
-            static const std::size_t size = sizeof(startup_env);
-            for (const auto &var : env) {
-                if (var.startsWith(startup_env)) {
-                    tmp = var.mid(size - 1);
-                }
+                path = "/sbin:/bin:/usr/sbin:/usr/bin";
             }
-            if (tmp.isEmpty()) {
-                tmp = "0"; // krazy:exclude=doublequote_chars
-            }
-            writeLine(tmp);
-        } else if (line == "app_start_pid") { // obsolete
-            // Force the pid_t returned from getpid() into
-            // something QByteArray understands; avoids ambiguity
-            // between short and unsigned short in particular.
-            tmp.setNum((PIDType<sizeof(pid_t)>::PID_t)(getpid()));
-            writeLine(tmp);
-        } else if (line == "environment") { // additional env vars
-            const QList<QByteArray> env = environment();
-            for (const auto &var : env) {
-                writeString(var);
+        }
+        return path;
+    } else if (name == "user") {
+        return m_user;
+    } else if (name == "priority") {
+        return QByteArray::number(m_priority);
+    } else if (name == "scheduler") {
+        // Stubs before 6.28 run anything but "realtime" as "normal"
+        switch (m_scheduler) {
+        case SchedRealtime:
+            return QByteArray("realtime");
+        case SchedRoundRobin:
+            return QByteArray("roundrobin");
+        case SchedBatch:
+            return QByteArray("batch");
+        case SchedIdle:
+            return QByteArray("idle");
+        case SchedDeadline:
+            return "deadline " + QByteArray::number(d->deadlineRuntime) + ' ' + QByteArray::number(d->deadlineDeadline) + ' '
+                + QByteArray::number(d->deadlinePeriod);
+        default:
+            return QByteArray("normal");
+        }
+    } else if (name == "cpu_affinity") {
+        return joinNumbers(d->cpuAffinity);
+    } else if (name == "numa_policy") {
+        switch (d->numaPolicy) {
+        case NumaBind:
+            return "bind " + joinNumbers(d->numaNodes);
+        case NumaInterleave:
+            return "interleave " + joinNumbers(d->numaNodes);
+        case NumaPreferred:
+            return "preferred " + joinNumbers(d->numaNodes);
+        default:
+            return QByteArray();
+        }
+    } else if (name == "io_priority") {
+        switch (d->ioClass) {
+        case IoRealtime:
+            return "realtime " + QByteArray::number(d->ioLevel);
+        case IoBestEffort:
+            return "best-effort " + QByteArray::number(d->ioLevel);
+        case IoIdle:
+            return QByteArray("idle");
+        default:
+            return QByteArray();
+        }
+    } else if (name == "oom_score_adj") {
+        return d->oomScoreAdjust ? QByteArray::number(*d->oomScoreAdjust) : QByteArray();
+    } else if (name == "cgroup") {
+        return d->cgroupParent;
+    } else if (name == "cgroup_cpu_max") {
+        return d->cgroupLimits[CgroupCpuMax];
+    } else if (name == "cgroup_memory_max") {
+        return d->cgroupLimits[CgroupMemoryMax];
+    } else if (name == "cgroup_io_max") {
+        return d->cgroupLimits[CgroupIoMax];
+    } else if (name == "cgroup_pids_max") {
+        return d->cgroupLimits[CgroupPidsMax];
+    } else if (name == "xwindows_only") {
+        return m_XOnly ? QByteArray("no") : QByteArray("yes");
+    } else if (name == "app_startup_id") {
+        const QList<QByteArray> env = environment();
+        QByteArray tmp;
+        static const char startup_env[] = "DESKTOP_STARTUP_ID=";
+        static const std::size_t size = sizeof(startup_env);
+        for (const auto &var : env) {
+            if (var.startsWith(startup_env)) {
+                tmp = var.mid(size - 1);
             }
-            writeLine("");
-        } else if (line == "end") {
-            return 0;
-        } else {
-            qCWarning(KSU_LOG) << "[" << __FILE__ << ":" << __LINE__ << "] "
-                               << "Unknown request:" << line;
-            return 1;
         }
+        if (tmp.isEmpty()) {
+            tmp = "0"; // krazy:exclude=doublequote_chars
+        }
+        return tmp;
     }
+    return std::nullopt;
+}
 
-    return 0;
+void StubProcess::fetchCookie()
+{
+    m_cookie->fetch();
 }
 
 QByteArray StubProcess::display()
@@ -15,12 +15,15 @@
 #include <QByteArray>
 #include <QList>
 
+#include <optional>
+
 namespace KDESu
 {
 namespace KDESuPrivate
 {
 class KCookie;
 }
+class ExecJobPrivate;
 class StubProcessPrivate;
 
 /*!
@@ -40,11 +43,75 @@ public:
      * scheduler, while SchedRealtime is a POSIX.1b realtime scheduler.
      *
      * \value SchedNormal
-     * \value SchedRealtime
+     * \value SchedRealtime First in, first out realtime scheduling (SCHED_FIFO)
+     * \value SchedRoundRobin Round robin realtime scheduling (SCHED_RR), since 6.28
+     * \value SchedBatch Timesharing for CPU bound jobs (SCHED_BATCH), since 6.28
+     * \value SchedIdle Runs only when nothing else does (SCHED_IDLE), since 6.28
+     * \value SchedDeadline Earliest deadline first (SCHED_DEADLINE), see setDeadline(), since 6.28
+     *
+     * The realtime schedulers SchedRealtime, SchedRoundRobin and
+     * SchedDeadline are set up as root, so they need the root password.
+     * SchedBatch, SchedIdle and SchedDeadline are Linux specific, the
+     * command runs with SchedNormal elsewhere.
      */
     enum Scheduler {
         SchedNormal,
         SchedRealtime,
+        SchedRoundRobin,
+        SchedBatch,
+        SchedIdle,
+        SchedDeadline,
+    };
+
+    /*!
+     * Memory policies, see setNumaPolicy().
+     *
+     * \value NumaDefault Allocate on the node the process runs on
+     * \value NumaBind Allocate only on the given nodes
+     * \value NumaInterleave Interleave allocations over the given nodes
+     * \value NumaPreferred Allocate on the given node if possible
+     *
+     * \since 6.28
+     */
+    enum NumaPolicy {
+        NumaDefault,
+        NumaBind,
+        NumaInterleave,
+        NumaPreferred,
+    };
+
+    /*!
+     * I/O scheduling classes, see setIoPriority().
+     *
+     * \value IoDefault Leave the I/O priority alone
+     * \value IoRealtime Served before everything else, needs root
+     * \value IoBestEffort The default class, ordered by level
+     * \value IoIdle Served only when the disk is otherwise idle
+     *
+     * \since 6.28
+     */
+    enum IoPriorityClass {
+        IoDefault,
+        IoRealtime,
+        IoBestEffort,
+        IoIdle,
+    };
+
+    /*!
+     * cgroup v2 limits, see setCgroupLimit().
+     *
+     * \value CgroupCpuMax cpu.max, "<quota> <period>" in microseconds
+     * \value CgroupMemoryMax memory.max, in bytes
+     * \value CgroupIoMax io.max, "<major>:<minor> rbps=<n> wbps=<n>..." per device
+     * \value CgroupPidsMax pids.max, the number of processes
+     *
+     * \since 6.28
+     */
+    enum CgroupLimit {
+        CgroupCpuMax,
+        CgroupMemoryMax,
+        CgroupIoMax,
+        CgroupPidsMax,
     };
 
     /*!
@@ -54,10 +121,23 @@ public:
     ~StubProcess() override;
 
     /*!
-     * Set the command.
+     * Set the command. It is run by /bin/sh.
      */
     void setCommand(const QByteArray &command);
 
+    /*!
+     * Set the command as a list of \a arguments, the first of which is the
+     * program. It is run directly, without a shell and without the quoting
+     * a command for the shell needs. The program is looked up in PATH.
+     *
+     * This replaces a command set with setCommand(), and vice versa. A
+     * kdesu_stub from before 6.28 runs the arguments through the shell,
+     * quoted as needed.
+     *
+     * \since 6.28
+     */
+    void setArguments(const QList<QByteArray> &arguments);
+
     /*!
      * Set the target user.
      */
@@ -80,6 +160,97 @@ public:
      */
     void setScheduler(int sched);
 
+    /*!
+     * Set the parameters of SchedDeadline: the process gets \a runtime of
+     * CPU time in every \a period, within \a deadline from the start of
+     * the period. All in nanoseconds, a \a period of 0 means the same as
+     * \a deadline.
+     *
+     * A process with SchedDeadline can not fork, so the command should be
+     * a program set with setArguments() rather than a shell command. For
+     * the same reason exec() fails when an X11 cookie has to be passed on
+     * to the command. A CPU affinity, see setCpuAffinity(), has to cover
+     * all CPUs of the root domain, or the kernel refuses the scheduler.
+     *
+     * \since 6.28
+     */
+    void setDeadline(qint64 runtime, qint64 deadline, qint64 period = 0);
+
+    /*!
+     * Restrict the command to the CPUs numbered in \a cpus. An empty list,
+     * the default, leaves the affinity alone.
+     *
+     * Like setNumaPolicy(), this is Linux specific, and needs a kdesu_stub
+     * of 6.28 or later. Older stubs ignore it.
+     *
+     * \since 6.28
+     */
+    void setCpuAffinity(const QList<int> &cpus);
+
+    /*!
+     * Set the memory \a policy of the command, for the NUMA \a nodes.
+     *
+     * \since 6.28
+     */
+    void setNumaPolicy(NumaPolicy policy, const QList<int> &nodes);
+
+    /*!
+     * Set the I/O scheduling class of the command to \a ioClass, with
+     * \a level from 0 (highest) to 7 (lowest) for IoRealtime and
+     * IoBestEffort. IoIdle lets backup and indexing jobs run without
+     * slowing down the desktop.
+     *
+     * Like setOomScoreAdjust(), this is Linux specific, and needs a
+     * kdesu_stub of 6.28 or later. Older stubs ignore it.
+     *
+     * \since 6.28
+     */
+    void setIoPriority(IoPriorityClass ioClass, int level = 4);
+
+    /*!
+     * Set the oom_score_adj of the command to \a adjust, from -1000 (never
+     * killed when out of memory) to 1000 (killed first). Negative values
+     * need root.
+     *
+     * \since 6.28
+     */
+    void setOomScoreAdjust(int adjust);
+
+    /*!
+     * Run the command in a new cgroup kdesu-<pid> below \a parent, a path
+     * in the cgroup v2 hierarchy such as a slice delegated to the user.
+     * Nothing is changed for an empty \a parent, the default.
+     *
+     * The command is not started if the cgroup can not be set up. The
+     * cgroup is left in place once the command has exited, see
+     * cgroupPath().
+     *
+     * This is Linux specific, and needs a kdesu_stub of 6.28 or later.
+     * Older stubs ignore it.
+     *
+     * \since 6.28
+     */
+    void setCgroup(const QByteArray &parent);
+
+    /*!
+     * Set \a limit of the cgroup, see setCgroup(), to \a value in the format
+     * of the kernel, for example "max" or "50000 100000" for CgroupCpuMax.
+     * CgroupIoMax takes one device per line.
+     *
+     * \since 6.28
+     */
+    void setCgroupLimit(CgroupLimit limit, const QByteArray &value);
+
+    /*!
+     * Returns the path of the cgroup the command runs in, relative to the
+     * root of the cgroup v2 hierarchy, or an empty array if no cgroup was
+     * set up. Its usage, like cpu.stat or memory.peak, can still be read
+     * after the command has exited. Removing it is up to the caller.
+     *
+     * \since 6.28
+     */
+    QByteArray cgroupPath() const;
+
 protected:
     void virtual_hook(int id, void *data) override;
 
@@ -99,6 +270,12 @@ protected:
      */
     virtual QByteArray displayAuth();
 
+    /*
+     * Starts looking up the X11 cookie in the background, for display()
+     * and displayAuth() to return later.
+     */
+    KDESU_NO_EXPORT void fetchCookie();
+
     // KF6 TODO: move to StubProcessPrivate
     bool m_XOnly;
     int m_priority;
@@ -109,6 +286,10 @@ protected:
 
 private:
     KDESU_NO_EXPORT void writeString(const QByteArray &str);
+    KDESU_NO_EXPORT int converseStubLine(const QByteArray &line, int check);
+    KDESU_NO_EXPORT std::optional<QByteArray> stubParameter(const QByteArray &name);
+
+    friend class ExecJobPrivate;
 
 protected:
     KDESU_NO_EXPORT explicit StubProcess(StubProcessPrivate &dd);
@@ -9,11 +9,47 @@
 #define KDESUSTUBPROCESS_P_H
 
 #include "ptyprocess_p.h"
+#include "stubprocess.h"
 
 namespace KDESu
 {
+/*
+ * The conversations with su, ssh and kdesu_stub are fed one line at a
+ * time, so that both exec() and ExecJob can drive them. Besides their own
+ * results they return one of these.
+ */
+enum ConverseStatus {
+    // Feed the next line
+    ConverseContinue = -100,
+    // Write the password, once the slave has turned off ECHO
+    ConverseWritePassword = -101,
+};
+
 class StubProcessPrivate : public PtyProcessPrivate
 {
+public:
+    // Whether the "kdesu_stub" header has been answered
+    bool stubHeaderSeen = false;
+    // Set with setArguments(), m_command is the same quoted for the shell
+    QList<QByteArray> arguments;
+    // Parameters of SchedDeadline in nanoseconds, see setDeadline()
+    qint64 deadlineRuntime = 0;
+    qint64 deadlineDeadline = 0;
+    qint64 deadlinePeriod = 0;
+    QList<int> cpuAffinity;
+    StubProcess::NumaPolicy numaPolicy = StubProcess::NumaDefault;
+    QList<int> numaNodes;
+    StubProcess::IoPriorityClass ioClass = StubProcess::IoDefault;
+    int ioLevel = 4;
+    std::optional<int> oomScoreAdjust;
+    QByteArray cgroupParent;
+    // Indexed by StubProcess::CgroupLimit
+    QByteArray cgroupLimits[4];
+    // Reported by kdesu_stub
+    QByteArray cgroupPath;
+
+    // Whether the settings above need the stub to run as root
+    bool needsRoot() const;
 };
 
 }
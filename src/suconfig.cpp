@@ -0,0 +1,76 @@
+/*
+    This file is part of the KDE project, module kdesu
+    SPDX-FileCopyrightText: 2026 KDE Contributors
+
+    SPDX-License-Identifier: GPL-2.0-only
+
+    suconfig.cpp: Cached "super-user-command" configuration.
+*/
+
+#include "suconfig_p.h"
+
+#include <config-kdesu.h>
+
+#include <QMutex>
+#include <QStandardPaths>
+
+#include <KConfigGroup>
+#include <KSharedConfig>
+
+namespace KDESu
+{
+namespace KDESuPrivate
+{
+Q_CONSTINIT static QMutex s_mutex;
+static std::shared_ptr<const SuConfig> s_config;
+
+std::shared_ptr<const SuConfig> SuConfig::current()
+{
+    // KSharedConfig keeps the parsed file in memory, reading it is cheap
+    KSharedConfig::Ptr config = KSharedConfig::openConfig();
+    KConfigGroup group(config, QStringLiteral("super-user-command"));
+    const QString superUserCommand = group.readEntry("super-user-command", QString());
+    const QString defaultStubPath = QStringLiteral(KDE_INSTALL_FULL_LIBEXECDIR_KF) + QStringLiteral("/kdesu_stub");
+    const QByteArray stubPath = group.readEntry("kdesu_stub_path", defaultStubPath).toLocal8Bit();
+    const QByteArray command = group.readEntry("command", QString()).toLocal8Bit();
+    const QByteArray path = qgetenv("PATH");
+
+    QMutexLocker locker(&s_mutex);
+    if (s_config && s_config->superUserCommand == superUserCommand && s_config->stubPath == stubPath && s_config->command == command
+        && s_config->path == path) {
+        return s_config;
+    }
+
+    auto snapshot = std::make_shared<SuConfig>();
+    snapshot->superUserCommand = superUserCommand;
+    snapshot->stubPath = stubPath;
+    snapshot->command = command;
+    snapshot->path = path;
+    for (const QString &name : {QStringLiteral("su"), QStringLiteral("sudo"), QStringLiteral("doas")}) {
+        snapshot->executables.insert(name, QStandardPaths::findExecutable(name).toLocal8Bit());
+    }
+    s_config = snapshot;
+    return s_config;
+}
+
+std::shared_ptr<const SuConfig> SuConfig::cached()
+{
+    {
+        QMutexLocker locker(&s_mutex);
+        if (s_config) {
+            return s_config;
+        }
+    }
+    return current();
+}
+
+QByteArray SuConfig::executable(const QString &superUserCommand) const
+{
+    if (!command.isEmpty()) {
+        return command;
+    }
+    return executables.value(superUserCommand);
+}
+
+}
+}
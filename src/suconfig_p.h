@@ -0,0 +1,62 @@
+/*
+    This file is part of the KDE project, module kdesu
+    SPDX-FileCopyrightText: 2026 KDE Contributors
+
+    SPDX-License-Identifier: GPL-2.0-only
+*/
+
+#ifndef KDESUSUCONFIG_P_H
+#define KDESUSUCONFIG_P_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QString>
+
+#include <memory>
+
+namespace KDESu
+{
+namespace KDESuPrivate
+{
+/*!
+ * Immutable snapshot of the "super-user-command" configuration, together
+ * with the resolved paths of su, sudo and doas.
+ * \internal
+ */
+class SuConfig
+{
+public:
+    /*!
+     * Returns the snapshot matching the current configuration. The
+     * configuration is only compared in memory, the executables are looked
+     * up again only when it or PATH changed.
+     */
+    static std::shared_ptr<const SuConfig> current();
+
+    /*!
+     * Returns the last snapshot, without looking at the configuration
+     * unless there is none yet. For the polling paths.
+     */
+    static std::shared_ptr<const SuConfig> cached();
+
+    /*!
+     * Returns the command to run for \a superUserCommand: the configured
+     * "command" if set, or the executable found in PATH.
+     */
+    QByteArray executable(const QString &superUserCommand) const;
+
+    // "super-user-command" as configured, empty if not set
+    QString superUserCommand;
+    QByteArray stubPath;
+    // "command", overrides the executable, used in tests
+    QByteArray command;
+
+private:
+    QByteArray path;
+    QHash<QString, QByteArray> executables;
+};
+
+}
+}
+
+#endif
@@ -13,18 +13,29 @@
 #include "suprocess.h"
 
 #include "kcookie_p.h"
-#include "stubprocess_p.h"
+#include "kdesutrace_p.h"
+#include "suprocess_p.h"
 #include <ksu_debug.h>
 
+#include <QCryptographicHash>
+#include <QDeadlineTimer>
+#include <QElapsedTimer>
 #include <QFile>
-#include <QStandardPaths>
+#include <QHash>
+#include <QMutex>
+#include <QRandomGenerator>
+#include <QScopeGuard>
 #include <qplatformdefs.h>
 
-#include <KConfig>
-#include <KConfigGroup>
-#include <KSharedConfig>
 #include <kuser.h>
 
+#include <atomic>
+#include <cerrno>
+#include <optional>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
 #if defined(KDESU_USE_SUDO_DEFAULT)
 #define DEFAULT_SUPER_USER_COMMAND QStringLiteral("sudo")
 #elif defined(KDESU_USE_DOAS_DEFAULT)
@@ -33,20 +44,136 @@
 #define DEFAULT_SUPER_USER_COMMAND QStringLiteral("su")
 #endif
 
+extern char **environ;
+
 namespace KDESu
 {
 using namespace KDESuPrivate;
 
-class SuProcessPrivate : public StubProcessPrivate
+// Set once sudo refused to run without a terminal, see SuProcess::start()
+static std::atomic<bool> s_sudoNeedsTty = false;
+
+bool SuProcessPrivate::isPrivilegeEscalation() const
+{
+    return (superUserCommand == QLatin1String("sudo") || superUserCommand == QLatin1String("doas"));
+}
+
+void SuProcessPrivate::selectSuperUserCommand(const QByteArray &user)
+{
+    if (user != QByteArray("root")) {
+        superUserCommand = QStringLiteral("su");
+    }
+}
+
+namespace
+{
+/*
+ * Results of checkInstall() and checkNeedPassword(), so repeated dialogs
+ * don't spawn su and kdesu_stub every time. An entry is dropped after
+ * 30 seconds, or once the backend or the stub have been modified. The
+ * autotests shorten the lifetime with $KDESU_CHECK_CACHE_TTL, in
+ * milliseconds.
+ */
+class CheckCache
 {
 public:
-    bool isPrivilegeEscalation() const;
-    QString superUserCommand;
+    CheckCache()
+    {
+        const quint64 random[2] = {QRandomGenerator::system()->generate64(), QRandomGenerator::system()->generate64()};
+        salt = QByteArray(reinterpret_cast<const char *>(random), sizeof(random));
+    }
+
+    std::optional<int> find(const QByteArray &key, const QList<qint64> &stamp)
+    {
+        QMutexLocker locker(&mutex);
+        auto it = entries.find(key);
+        if (it == entries.end()) {
+            return std::nullopt;
+        }
+        if (it->expiry.hasExpired() || it->stamp != stamp) {
+            entries.erase(it);
+            return std::nullopt;
+        }
+        return it->result;
+    }
+
+    void insert(const QByteArray &key, const QList<qint64> &stamp, int result)
+    {
+        bool ok;
+        int ttl = qEnvironmentVariableIntValue("KDESU_CHECK_CACHE_TTL", &ok);
+        if (!ok) {
+            ttl = 30 * 1000;
+        }
+
+        QMutexLocker locker(&mutex);
+        entries.insert(key, {stamp, QDeadlineTimer(ttl), result});
+    }
+
+    void remove(const QByteArray &prefix)
+    {
+        QMutexLocker locker(&mutex);
+        entries.removeIf([&prefix](QHash<QByteArray, Entry>::iterator it) {
+            return it.key().startsWith(prefix);
+        });
+    }
+
+    // Only a salted hash of the password ends up in a key
+    QByteArray passwordHash(const char *password) const
+    {
+        QCryptographicHash hash(QCryptographicHash::Sha256);
+        hash.addData(salt);
+        hash.addData(QByteArrayView(password));
+        return hash.result();
+    }
+
+private:
+    struct Entry {
+        QList<qint64> stamp;
+        QDeadlineTimer expiry;
+        int result;
+    };
+
+    QMutex mutex;
+    QHash<QByteArray, Entry> entries;
+    QByteArray salt;
 };
+}
 
-bool SuProcessPrivate::isPrivilegeEscalation() const
+Q_GLOBAL_STATIC(CheckCache, s_checkCache)
+
+static qint64 modificationTime(const QByteArray &path)
 {
-    return (superUserCommand == QLatin1String("sudo") || superUserCommand == QLatin1String("doas"));
+    QT_STATBUF st;
+    if (QT_STAT(path.constData(), &st) < 0) {
+        return -1;
+    }
+    return qint64(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+/*
+ * The backend, the check, the user and the stub make the key, in that order,
+ * so authenticated() can drop by prefix. The modification times are
+ * compared separately.
+ */
+QByteArray SuProcessPrivate::checkCacheKey(const QByteArray &user, int check, const char *password) const
+{
+    QByteArray key = superUserCommand.toLatin1() + '\0' + QByteArray::number(check) + '\0' + user + '\0' + config->stubPath;
+    if (password) {
+        key += '\0' + s_checkCache->passwordHash(password);
+    }
+    return key;
+}
+
+static QList<qint64> checkCacheStamp(const KDESuPrivate::SuConfig &config, const QString &superUserCommand)
+{
+    return {modificationTime(config.executable(superUserCommand)), modificationTime(config.stubPath)};
+}
+
+void SuProcessPrivate::authenticated()
+{
+    if (isPrivilegeEscalation()) {
+        s_checkCache->remove(superUserCommand.toLatin1() + '\0' + QByteArray::number(SuProcess::NeedPassword) + '\0');
+    }
 }
 
 SuProcess::SuProcess(const QByteArray &user, const QByteArray &command)
@@ -57,9 +184,12 @@ SuProcess::SuProcess(const QByteArray &user, const QByteArray &command)
     m_user = user;
     m_command = command;
 
-    KSharedConfig::Ptr config = KSharedConfig::openConfig();
-    KConfigGroup group(config, QStringLiteral("super-user-command"));
-    d->superUserCommand = group.readEntry("super-user-command", DEFAULT_SUPER_USER_COMMAND);
+    d->wantPacketMode = true;
+    d->config = SuConfig::current();
+    d->superUserCommand = d->config->superUserCommand;
+    if (d->superUserCommand.isEmpty()) {
+        d->superUserCommand = DEFAULT_SUPER_USER_COMMAND;
+    }
 
     if (!d->isPrivilegeEscalation() && d->superUserCommand != QLatin1String("su")) {
         qCWarning(KSU_LOG) << "unknown super user command.";
@@ -90,37 +220,141 @@ bool SuProcess::useUsersOwnPassword()
 
 int SuProcess::checkInstall(const char *password)
 {
-    return exec(password, Install);
+    Q_D(SuProcess);
+
+    d->selectSuperUserCommand(m_user);
+    // Only successful checks are cached, a wrong password is cheap to try
+    // again and the next one might be right
+    const QByteArray key = d->checkCacheKey(m_user, Install, password);
+    const QList<qint64> stamp = checkCacheStamp(*d->config, d->superUserCommand);
+    if (s_checkCache->find(key, stamp)) {
+        return 0;
+    }
+
+    const int ret = exec(password, Install);
+    if (ret == 0) {
+        s_checkCache->insert(key, stamp, ret);
+    }
+    return ret;
+}
+
+/*
+ * Asks sudo or doas whether @p user can be switched to without a password.
+ * With -n they fail instead of prompting, so there is no PTY and no
+ * conversation, and nothing is left running. Returns 0 if no password is
+ * needed, 1 if one is and -1 if the probe could not be run.
+ * The probe gets /dev/null as stdin, stdout and stderr, and none of our
+ * other fds: the PTY master, the socket of the channel and the pidfd are
+ * close-on-exec anyway, closing everything else covers the fds of the
+ * application.
+ */
+static int runNeedPasswordProbe(const QByteArray &command, const QByteArray &user)
+{
+    const char *argv[] = {command.constData(), "-n", "-u", user.constData(), "true", nullptr};
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    for (int fd = 0; fd < 3; ++fd) {
+        posix_spawn_file_actions_addopen(&actions, fd, "/dev/null", fd == 0 ? O_RDONLY : O_WRONLY, 0);
+    }
+#if HAVE_POSIX_SPAWN_ADDCLOSEFROM
+    posix_spawn_file_actions_addclosefrom_np(&actions, 3);
+#endif
+    pid_t pid;
+    const int err = posix_spawnp(&pid, argv[0], &actions, nullptr, const_cast<char *const *>(argv), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err) {
+        qCCritical(KSU_LOG) << "[" << __FILE__ << ":" << __LINE__ << "] "
+                            << "posix_spawn():" << strerror(err);
+        return -1;
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    if (!WIFEXITED(status)) {
+        return -1;
+    }
+    return WEXITSTATUS(status) == 0 ? 0 : 1;
 }
 
 int SuProcess::checkNeedPassword()
 {
+    Q_D(SuProcess);
+
+    d->selectSuperUserCommand(m_user);
+    const QByteArray key = d->checkCacheKey(m_user, NeedPassword, nullptr);
+    const QList<qint64> stamp = checkCacheStamp(*d->config, d->superUserCommand);
+    if (const auto cached = s_checkCache->find(key, stamp)) {
+        return *cached;
+    }
+
+    const int ret = probeNeedPassword();
+    if (ret == ok || ret == killme) {
+        s_checkCache->insert(key, stamp, ret);
+    }
+    return ret;
+}
+
+int SuProcess::probeNeedPassword()
+{
+    Q_D(SuProcess);
+
+    // su has no non-interactive mode, and start() switches to it for
+    // other users than root.
+    if (m_user == "root" && d->isPrivilegeEscalation()) {
+        const QByteArray command = d->config->executable(d->superUserCommand);
+        if (!command.isEmpty()) {
+            const int ret = runNeedPasswordProbe(command, m_user);
+            if (ret >= 0) {
+                return ret ? killme : ok;
+            }
+        }
+    }
+
     return exec(nullptr, NeedPassword);
 }
 
 /*
- * Execute a command with su(1).
+ * Start su(1) with kdesu_stub. Returns 0 on success, otherwise the value
+ * for exec() to return.
  */
-int SuProcess::exec(const char *password, int check)
+int SuProcess::start(int check)
 {
     Q_D(SuProcess);
 
-    if (check) {
-        setTerminal(true);
-    }
-
     // since user may change after constructor (due to setUser())
     // we need to override sudo with su for non-root here
-    if (m_user != QByteArray("root")) {
-        d->superUserCommand = QStringLiteral("su");
-    }
+    d->selectSuperUserCommand(m_user);
+
+    // sudo can read the password from stdin. The child then runs without a
+    // PTY, and there is neither a prompt to scrape from a terminal nor an
+    // echo mode to wait for. Only a terminal user needs a real tty.
+    const bool viaStdin = d->superUserCommand == QLatin1String("sudo") && !m_terminal && !s_sudoNeedsTty;
 
     QList<QByteArray> args;
+    d->promptSentinel.clear();
+    d->ttyRequired = false;
+    if (d->superUserCommand == QLatin1String("sudo")) {
+        if (viaStdin) {
+            args += "-S";
+        }
+        // Avoid '%', sudo expands escapes in the prompt. The colon makes
+        // a second prompt fail the conversation, like any other prompt.
+        const quint64 random[2] = {QRandomGenerator::system()->generate64(), QRandomGenerator::system()->generate64()};
+        d->promptSentinel = "kdesu-" + QByteArray(reinterpret_cast<const char *>(random), sizeof(random)).toHex() + ':';
+        args += "-p";
+        args += d->promptSentinel;
+    }
     if (d->isPrivilegeEscalation()) {
         args += "-u";
     }
 
-    if (m_scheduler != SchedNormal || m_priority > 50) {
+    // Realtime scheduling and raising the priority need root
+    if (m_scheduler == SchedRealtime || m_scheduler == SchedRoundRobin || m_scheduler == SchedDeadline || m_priority > 50 || d->needsRoot()) {
         args += "root";
     } else {
         args += m_user;
@@ -129,16 +363,11 @@ int SuProcess::exec(const char *password, int check)
     if (d->superUserCommand == QLatin1String("su")) {
         args += "-c";
     }
-    // Get the kdesu_stub and su command from a config file if set, used in test
-    KSharedConfig::Ptr config = KSharedConfig::openConfig();
-    KConfigGroup group(config, QStringLiteral("super-user-command"));
-    const QString defaultPath = QStringLiteral(KDE_INSTALL_FULL_LIBEXECDIR_KF) + QStringLiteral("/kdesu_stub");
-    const QString kdesuStubPath = group.readEntry("kdesu_stub_path", defaultPath);
-    args += kdesuStubPath.toLocal8Bit();
+    // The kdesu_stub and su command can be set in the config file, used in test
+    args += d->config->stubPath;
     args += "-"; // krazy:exclude=doublequote_chars (QList, not QString)
 
-    const QString commandString = group.readEntry("command", QStandardPaths::findExecutable(d->superUserCommand));
-    const QByteArray command = commandString.toLocal8Bit();
+    const QByteArray command = d->config->executable(d->superUserCommand);
     if (command.isEmpty()) {
         return check ? SuNotFound : -1;
     }
@@ -147,11 +376,51 @@ int SuProcess::exec(const char *password, int check)
     // it's started so that sudo copies this option to its internal PTY.
     enableLocalEcho(false);
 
-    if (StubProcess::exec(command, args) < 0) {
+    // Checks answer "stop" before the stub asks for the display
+    if (!check) {
+        fetchCookie();
+    }
+
+    if ((viaStdin ? execWithoutPty(command, args) : StubProcess::exec(command, args)) < 0) {
         return check ? SuNotFound : -1;
     }
+    return 0;
+}
+
+/*
+ * Execute a command with su(1).
+ */
+int SuProcess::exec(const char *password, int check)
+{
+    Q_D(SuProcess);
+
+    QElapsedTimer total;
+    total.start();
+    d->resetTimings();
+    auto finishTimings = qScopeGuard([d, &total] {
+        d->finishTimings(total, d->superUserCommand.toLatin1().constData());
+    });
+
+    if (check) {
+        setTerminal(true);
+    }
+
+    if (int ret = start(check)) {
+        return ret;
+    }
 
+    QElapsedTimer promptTimer;
+    promptTimer.start();
     SuErrors ret = (SuErrors)converseSU(password);
+    if (ret == error && d->ttyRequired) {
+        // sudo is configured with requiretty, start over on a PTY
+        waitForChild();
+        if (int iret = start(check)) {
+            return iret;
+        }
+        ret = (SuErrors)converseSU(password);
+    }
+    d->timings.prompt = promptTimer.nsecsElapsed();
 
     if (ret == error) {
         if (!check) {
@@ -188,6 +457,7 @@ int SuProcess::exec(const char *password, int check)
     if (ret != ok) {
         kill(m_pid, SIGKILL);
         if (d->isPrivilegeEscalation()) {
+            d->closeInput();
             waitForChild();
         }
         return SuIncorrectPassword;
@@ -202,9 +472,11 @@ int SuProcess::exec(const char *password, int check)
         return iret;
     } else if (iret == 1) {
         kill(m_pid, SIGKILL);
+        d->closeInput();
         waitForChild();
         return SuIncorrectPassword;
     }
+    d->authenticated();
 
     if (check == Install) {
         waitForChild();
@@ -221,38 +493,95 @@ int SuProcess::exec(const char *password, int check)
  */
 int SuProcess::converseSU(const char *password)
 {
-    enum {
-        WaitForPrompt,
-        CheckStar,
-        HandleStub,
-    } state = WaitForPrompt;
-    int colon;
-    unsigned i;
-    unsigned j;
+    Q_D(SuProcess);
 
-    QByteArray line;
+    d->converseState = SuProcessPrivate::WaitForPrompt;
     while (true) {
-        line = readLine();
-        // return if problem. sudo checks for a second prompt || su gets a blank line
-        if ((line.contains(':') && state != WaitForPrompt) || line.isNull()) {
-            return (state == HandleStub ? notauthorized : error);
-        }
-
-        if (line == "kdesu_stub") {
-            unreadLine(line);
-            return ok;
-        }
-
-        switch (state) {
-        case WaitForPrompt: {
-            if (waitMS(fd(), 100) > 0) {
+        const QByteArray line = readLine();
+        if (d->converseState == SuProcessPrivate::WaitForPrompt && !line.isNull() && line != "kdesu_stub") {
+            if (isPartialSentinel(line)) {
+                // Wait for the rest of the prompt
+                unreadLine(line, false);
+                if (d->readInput(true) < 0) {
+                    return error;
+                }
+                continue;
+            }
+            // PAM modules may replace the sentinel with their own prompt
+            if (!isSentinel(line) && waitForOutput(100) > 0) {
                 // There is more output available, so this line
                 // couldn't have been a password prompt (the definition
                 // of prompt being that  there's a line of output followed
                 // by a colon, and then the process waits).
                 continue;
             }
+        }
 
+        const int ret = converseSULine(line, password != nullptr);
+        if (ret == ConverseWritePassword) {
+            if (waitSlave()) {
+                return error;
+            }
+            writeLine(QByteArray::fromRawData(password, qstrlen(password)));
+            KDESU_TRACE1(password_written, m_pid);
+        } else if (ret != ConverseContinue) {
+            return ret;
+        }
+    }
+}
+
+/*
+ * Whether @p line is the start of the sentinel prompt, the rest of which
+ * has not been read yet.
+ */
+bool SuProcess::isPartialSentinel(const QByteArray &line)
+{
+    Q_D(SuProcess);
+
+    return !line.isEmpty() && line.size() < d->promptSentinel.size() && d->promptSentinel.startsWith(line);
+}
+
+/*
+ * Whether @p line is the sentinel prompt passed to sudo with -p.
+ */
+bool SuProcess::isSentinel(const QByteArray &line)
+{
+    Q_D(SuProcess);
+
+    return !d->promptSentinel.isEmpty() && line == d->promptSentinel;
+}
+
+/*
+ * Handle one line of the conversation with su. Apart from the sentinel
+ * prompt, a line in the WaitForPrompt state must only be passed when su is
+ * waiting for input after it.
+ * Returns the same values as converseSU(), ConverseContinue or
+ * ConverseWritePassword.
+ */
+int SuProcess::converseSULine(const QByteArray &line, bool havePassword)
+{
+    Q_D(SuProcess);
+
+    int colon;
+    unsigned i;
+    unsigned j;
+
+    // return if problem. sudo checks for a second prompt || su gets a blank line
+    if ((line.contains(':') && d->converseState != SuProcessPrivate::WaitForPrompt) || line.isNull()) {
+        return (d->converseState == SuProcessPrivate::HandleStub ? notauthorized : error);
+    }
+
+    if (line == "kdesu_stub") {
+        unreadLine(line);
+        return ok;
+    }
+
+    switch (d->converseState) {
+    case SuProcessPrivate::WaitForPrompt: {
+        bool isPrompt;
+        if (isSentinel(line)) {
+            isPrompt = true;
+        } else {
             const uint len = line.length();
             // Match "Password: " with the regex ^[^:]+:[\w]*$.
             for (i = 0, j = 0, colon = 0; i < len; ++i) {
@@ -265,42 +594,45 @@ int SuProcess::converseSU(const char *password)
                     j++;
                 }
             }
-            if (colon == 1 && line[j] == ':') {
-                if (password == nullptr) {
-                    return killme;
-                }
-                if (waitSlave()) {
-                    return error;
-                }
-                write(fd(), password, strlen(password));
-                write(fd(), "\n", 1);
-                state = CheckStar;
-            }
-            break;
+            isPrompt = colon == 1 && line[j] == ':';
         }
-        //////////////////////////////////////////////////////////////////////////
-        case CheckStar: {
-            const QByteArray s = line.trimmed();
-            if (s.isEmpty()) {
-                state = HandleStub;
-                break;
+        if (isPrompt) {
+            KDESU_TRACE1(prompt, line.constData());
+            if (!havePassword) {
+                return killme;
             }
-            const bool starCond = std::any_of(s.cbegin(), s.cend(), [](const char c) {
-                return c != '*';
-            });
-            if (starCond) {
-                return error;
-            }
-            state = HandleStub;
+            // Without a terminal, nothing echoes the password
+            d->converseState = d->channelFd >= 0 ? SuProcessPrivate::HandleStub : SuProcessPrivate::CheckStar;
+            return ConverseWritePassword;
+        }
+        if (d->channelFd >= 0 && line.contains("must have a tty")) {
+            d->ttyRequired = true;
+            s_sudoNeedsTty = true;
+        }
+        break;
+    }
+    //////////////////////////////////////////////////////////////////////////
+    case SuProcessPrivate::CheckStar: {
+        const QByteArray s = line.trimmed();
+        if (s.isEmpty()) {
+            d->converseState = SuProcessPrivate::HandleStub;
             break;
         }
+        const bool starCond = std::any_of(s.cbegin(), s.cend(), [](const char c) {
+            return c != '*';
+        });
+        if (starCond) {
+            return error;
+        }
+        d->converseState = SuProcessPrivate::HandleStub;
+        break;
+    }
+    //////////////////////////////////////////////////////////////////////////
+    case SuProcessPrivate::HandleStub:
+        break;
         //////////////////////////////////////////////////////////////////////////
-        case HandleStub:
-            break;
-            //////////////////////////////////////////////////////////////////////////
-        } // end switch
-    } // end while (true)
-    return ok;
+    } // end switch
+    return ConverseContinue;
 }
 
 void SuProcess::virtual_hook(int id, void *data)
@@ -14,6 +14,7 @@
 
 namespace KDESu
 {
+class ExecJobPrivate;
 class SuProcessPrivate;
 
 /*!
@@ -71,6 +72,12 @@ public:
 
     /*!
      * Checks if a password is needed.
+     *
+     * sudo and doas are asked in their non-interactive mode, which takes
+     * no password prompt and no PTY. su is started and killed at its
+     * password prompt.
+     *
+     * Returns zero if no password is needed, nonzero otherwise.
      */
     int checkNeedPassword();
 
@@ -99,7 +106,14 @@ private:
         notauthorized = 2,
     };
 
+    KDESU_NO_EXPORT int start(int check);
+    KDESU_NO_EXPORT int probeNeedPassword();
     KDESU_NO_EXPORT int converseSU(const char *password);
+    KDESU_NO_EXPORT int converseSULine(const QByteArray &line, bool havePassword);
+    KDESU_NO_EXPORT bool isPartialSentinel(const QByteArray &line);
+    KDESU_NO_EXPORT bool isSentinel(const QByteArray &line);
+
+    friend class ExecJobPrivate;
 
 private:
     Q_DECLARE_PRIVATE(SuProcess)
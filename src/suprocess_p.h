@@ -0,0 +1,46 @@
+/*
+    This file is part of the KDE project, module kdesu.
+    SPDX-FileCopyrightText: 1999, 2000 Geert Jansen <jansen@kde.org>
+
+    SPDX-License-Identifier: GPL-2.0-only
+*/
+
+#ifndef KDESUSUPROCESS_P_H
+#define KDESUSUPROCESS_P_H
+
+#include "stubprocess_p.h"
+#include "suconfig_p.h"
+
+#include <QString>
+
+namespace KDESu
+{
+class SuProcessPrivate : public StubProcessPrivate
+{
+public:
+    bool isPrivilegeEscalation() const;
+    // su is used for other users than root, whatever is configured
+    void selectSuperUserCommand(const QByteArray &user);
+    // Key for the result cache of checkInstall() and checkNeedPassword()
+    QByteArray checkCacheKey(const QByteArray &user, int check, const char *password) const;
+    // Forgets cached checkNeedPassword() results of the backend, which
+    // might remember the authentication that just succeeded
+    void authenticated();
+    QString superUserCommand;
+    std::shared_ptr<const KDESuPrivate::SuConfig> config;
+    // Random prompt passed to sudo with -p, matched exactly instead of
+    // guessing the prompt. Empty for backends without a custom prompt.
+    QByteArray promptSentinel;
+    // sudo refused to run without a terminal (requiretty)
+    bool ttyRequired = false;
+
+    enum {
+        WaitForPrompt,
+        CheckStar,
+        HandleStub,
+    } converseState = WaitForPrompt;
+};
+
+}
+
+#endif